@@ -0,0 +1,370 @@
+// Hash array mapped trie, after Bagwell, "Ideal Hash Trees" (2001).
+//
+// An immutable map: each node spends 5 bits of an item's hash choosing one
+// of 32 slots, and stores only the slots in use, with a bitmap saying which
+// those are. assoc and dissoc copy just the nodes on the path to the item,
+// so they are O(log32 n). Items whose hashes are equal in all 32 bits share
+// a collision node, which is searched linearly.
+//
+// Nodes come from Allocator::allocate, and are shared between maps, so they
+// are never freed explicitly. A garbage collector can find them with visit().
+//
+// A Transient builds a map in place: nodes it made itself are marked with
+// its edit id and are updated without copying, and grow their slot arrays
+// geometrically. Nodes it shares with any other map are copied first, as
+// in assoc.
+//
+// T must provide `uint32_t hash() const` and `bool same_key(const T&) const`.
+
+#ifndef HAMT_H
+#define HAMT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+
+// The default allocator, for nodes that are never freed.
+struct HAMTOperatorNew
+{
+  static void* allocate(size_t size) { return ::operator new(size); }
+};
+
+template<class T, class Allocator = HAMTOperatorNew>
+class HAMT
+{
+  struct Node;
+
+  // A slot holds either an item or, if child is set, a subtree.
+  struct Slot
+  {
+    T item;
+    const Node* child;
+  };
+
+  struct Node
+  {
+    uint32_t bitmap; // zero for a collision node
+    int count;
+    int capacity;
+    uint64_t edit;   // the Transient that may update it in place, or 0
+    Slot slots[1];   // really `capacity` of them, `count` in use
+
+    static Node* make(uint32_t bitmap, int count, uint64_t edit = 0,
+                      int capacity = 0)
+    {
+      capacity = std::max(count, capacity);
+      void* memory = Allocator::allocate(sizeof(Node) + (capacity - 1) * sizeof(Slot));
+      Node* node = static_cast<Node*>(memory);
+      node->bitmap = bitmap;
+      node->count = count;
+      node->capacity = capacity;
+      node->edit = edit;
+      for (int i = 0; i < capacity; i++)
+        new (&node->slots[i]) Slot{T(), nullptr};
+      return node;
+    }
+    bool is_collision() const { return bitmap == 0; }
+  };
+
+  static const int Bits = 5;
+  static const int Mask = (1 << Bits) - 1;
+  static const int HashBits = 32;
+
+  static uint32_t bit_for(uint32_t hash, int shift)
+  {
+    return 1u << ((hash >> shift) & Mask);
+  }
+  static int index_for(uint32_t bitmap, uint32_t bit)
+  {
+    return __builtin_popcount(bitmap & (bit - 1));
+  }
+
+  HAMT(const Node* root, int size) : _root(root), _size(size) {}
+
+public:
+  HAMT() : _root(nullptr), _size(0) {}
+
+  class Transient
+  {
+  public:
+    explicit Transient(const HAMT& from = HAMT())
+      : _root(from._root), _size(from._size), _edit(next_edit()) {}
+
+    void assoc(const T& item)
+    {
+      bool added = false;
+      _root = HAMT::assoc(_root, 0, item.hash(), item, added, _edit);
+      if (added)
+        _size++;
+    }
+
+    // The map so far. Later assocs copy rather than change its nodes.
+    HAMT persistent()
+    {
+      _edit = next_edit();
+      return HAMT(_root, _size);
+    }
+
+  private:
+    static uint64_t next_edit()
+    {
+      static uint64_t last = 0;
+      return ++last;
+    }
+
+    const Node* _root;
+    int _size;
+    uint64_t _edit;
+  };
+
+  int size() const { return _size; }
+
+  // Returns nullptr if there is no item with probe's key.
+  const T* find(const T& probe) const
+  {
+    uint32_t hash = probe.hash();
+    const Node* node = _root;
+    for (int shift = 0; node; shift += Bits)
+    {
+      if (node->is_collision())
+      {
+        for (int i = 0; i < node->count; i++)
+          if (node->slots[i].item.same_key(probe))
+            return &node->slots[i].item;
+        return nullptr;
+      }
+      uint32_t bit = bit_for(hash, shift);
+      if (!(node->bitmap & bit))
+        return nullptr;
+      const Slot& slot = node->slots[index_for(node->bitmap, bit)];
+      if (!slot.child)
+        return slot.item.same_key(probe) ? &slot.item : nullptr;
+      node = slot.child;
+    }
+    return nullptr;
+  }
+
+  // Adds item, replacing any item with the same key.
+  HAMT assoc(const T& item) const
+  {
+    bool added = false;
+    const Node* root = assoc(_root, 0, item.hash(), item, added, 0);
+    return HAMT(root, _size + (added ? 1 : 0));
+  }
+
+  HAMT dissoc(const T& probe) const
+  {
+    if (!_root)
+      return *this;
+    bool removed = false;
+    const Node* root = dissoc(_root, 0, probe.hash(), probe, removed);
+    return HAMT(root, _size - (removed ? 1 : 0));
+  }
+
+  template<class F>
+  void for_each(F&& f) const
+  {
+    if (_root)
+      for_each(_root, f);
+  }
+
+  // For a collector: calls on_node with the address of each node, and only
+  // if it returns true goes on to that node's children, calling on_item for
+  // each item in it.
+  template<class N, class I>
+  void visit(N&& on_node, I&& on_item) const
+  {
+    if (_root)
+      visit(_root, on_node, on_item);
+  }
+
+private:
+  template<class N, class I>
+  static void visit(const Node* node, N& on_node, I& on_item)
+  {
+    if (!on_node(static_cast<const void*>(node)))
+      return;
+    for (int i = 0; i < node->count; i++)
+    {
+      if (node->slots[i].child)
+        visit(node->slots[i].child, on_node, on_item);
+      else
+        on_item(node->slots[i].item);
+    }
+  }
+
+  template<class F>
+  static void for_each(const Node* node, F& f)
+  {
+    for (int i = 0; i < node->count; i++)
+    {
+      if (node->slots[i].child)
+        for_each(node->slots[i].child, f);
+      else
+        f(node->slots[i].item);
+    }
+  }
+
+  static Node* copy(const Node* node, uint32_t bitmap, int count)
+  {
+    Node* ret = Node::make(bitmap, count);
+    std::copy(node->slots, node->slots + std::min(count, node->count), ret->slots);
+    return ret;
+  }
+
+  // node itself if edit may update it and it has room for count slots,
+  // otherwise a copy of it that edit may update.
+  static Node* editable(const Node* node, uint64_t edit, uint32_t bitmap, int count)
+  {
+    Node* ret;
+    if (edit && node->edit == edit && count <= node->capacity)
+      ret = const_cast<Node*>(node);
+    else
+    {
+      // A transient leaves room to grow, so that filling a node takes a
+      // few copies rather than one per slot.
+      int capacity = edit ? std::min(2 * count, 1 << Bits) : count;
+      ret = Node::make(bitmap, count, edit, capacity);
+      std::copy(node->slots, node->slots + std::min(count, node->count), ret->slots);
+    }
+    ret->bitmap = bitmap;
+    ret->count = count;
+    return ret;
+  }
+
+  static const Node* assoc(const Node* node, int shift, uint32_t hash,
+                           const T& item, bool& added, uint64_t edit)
+  {
+    if (!node)
+    {
+      Node* ret = Node::make(bit_for(hash, shift), 1, edit, edit ? 2 : 1);
+      ret->slots[0].item = item;
+      added = true;
+      return ret;
+    }
+
+    int count = node->count;
+    if (node->is_collision())
+    {
+      for (int i = 0; i < count; i++)
+      {
+        if (node->slots[i].item.same_key(item))
+        {
+          Node* ret = editable(node, edit, 0, count);
+          ret->slots[i].item = item;
+          return ret;
+        }
+      }
+      Node* ret = editable(node, edit, 0, count + 1);
+      ret->slots[count].item = item;
+      added = true;
+      return ret;
+    }
+
+    uint32_t bit = bit_for(hash, shift);
+    int index = index_for(node->bitmap, bit);
+    if (!(node->bitmap & bit))
+    {
+      Node* ret = editable(node, edit, node->bitmap | bit, count + 1);
+      std::copy_backward(ret->slots + index, ret->slots + count, ret->slots + count + 1);
+      ret->slots[index] = Slot{item, nullptr};
+      added = true;
+      return ret;
+    }
+
+    Node* ret = editable(node, edit, node->bitmap, count);
+    Slot& slot = ret->slots[index];
+    if (slot.child)
+      slot.child = assoc(slot.child, shift + Bits, hash, item, added, edit);
+    else if (slot.item.same_key(item))
+      slot.item = item;
+    else
+    {
+      const Node* child = merge(slot.item, item, hash, shift + Bits, edit);
+      slot = Slot{T(), child};
+      added = true;
+    }
+    return ret;
+  }
+
+  // A node holding two items whose hashes agree below shift.
+  static const Node* merge(const T& a, const T& b, uint32_t b_hash, int shift,
+                           uint64_t edit)
+  {
+    uint32_t a_hash = a.hash();
+    if (shift >= HashBits)
+    {
+      Node* ret = Node::make(0, 2, edit);
+      ret->slots[0].item = a;
+      ret->slots[1].item = b;
+      return ret;
+    }
+    uint32_t a_bit = bit_for(a_hash, shift), b_bit = bit_for(b_hash, shift);
+    if (a_bit == b_bit)
+    {
+      Node* ret = Node::make(a_bit, 1, edit);
+      ret->slots[0].child = merge(a, b, b_hash, shift + Bits, edit);
+      return ret;
+    }
+    Node* ret = Node::make(a_bit | b_bit, 2, edit);
+    ret->slots[a_bit < b_bit ? 0 : 1].item = a;
+    ret->slots[a_bit < b_bit ? 1 : 0].item = b;
+    return ret;
+  }
+
+  // Returns nullptr if the node ends up empty.
+  static const Node* dissoc(const Node* node, int shift, uint32_t hash,
+                            const T& probe, bool& removed)
+  {
+    int index = -1;
+    uint32_t bit = 0;
+    if (node->is_collision())
+    {
+      for (int i = 0; i < node->count; i++)
+        if (node->slots[i].item.same_key(probe))
+          index = i;
+      if (index < 0)
+        return node;
+    }
+    else
+    {
+      bit = bit_for(hash, shift);
+      if (!(node->bitmap & bit))
+        return node;
+      index = index_for(node->bitmap, bit);
+      const Slot& slot = node->slots[index];
+      if (slot.child)
+      {
+        const Node* child = dissoc(slot.child, shift + Bits, hash, probe, removed);
+        if (child == slot.child)
+          return node;
+        if (child)
+        {
+          Node* ret = copy(node, node->bitmap, node->count);
+          // Pull a lone item up, so that shrinking maps stay shallow.
+          if (child->count == 1 && !child->slots[0].child)
+            ret->slots[index] = child->slots[0];
+          else
+            ret->slots[index].child = child;
+          return ret;
+        }
+        // The child is now empty: drop its slot below.
+      }
+      else if (!slot.item.same_key(probe))
+        return node;
+    }
+
+    removed = true;
+    if (node->count == 1)
+      return nullptr;
+    Node* ret = Node::make(node->bitmap & ~bit, node->count - 1);
+    std::copy(node->slots, node->slots + index, ret->slots);
+    std::copy(node->slots + index + 1, node->slots + node->count, ret->slots + index);
+    return ret;
+  }
+
+  const Node* _root;
+  int _size;
+};
+
+#endif
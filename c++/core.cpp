@@ -78,12 +78,24 @@ Env* core() {
   env->set(symbol("rest"), fn1<MalSeq>([](MalSeq* seq) -> MalSeq* {
     return seq->rest(); }));
   env->set(symbol("map"), fn2<MalFn, MalSeq>([](MalFn* f, MalSeq* seq) -> MalList* {
-    if (auto list = match<MalList>(seq))
-      return reduce([f](MalType* head, MalList* rest) -> MalList* {
-        return cons(f->apply(::list({head})), rest); }, list);
-    if (auto vec = match<MalVector>(seq))
-      return to_list(reduce([f](MalType* head, MalType* prev) -> MalType* {
-        return f->apply(::list({head})); }, vec, nullptr));
+    // The results so far must stay rooted while f runs.
+    if (auto list = match<MalList>(seq)) {
+      gc::Root<MalList> results(eol);
+      reduce([f, &results](MalType* head, MalList*) -> MalList* {
+        auto result = f->apply(::list({head}));
+        results = cons(result, results);
+        return results; }, list);
+      return results;
+    }
+    if (auto vec = match<MalVector>(seq)) {
+      gc::RootedVector<MalType> results;
+      for (auto item : vec->e)
+        results.push_back(f->apply(::list({item})));
+      ListBuilder builder;
+      for (auto result : results)
+        builder.push_back(result);
+      return builder.build();
+    }
     throw error("Expected Sequence");
   }));
   env->set(symbol("sequential?"), fn1([](MalType* arg) -> MalType* {
@@ -113,21 +125,9 @@ Env* core() {
   env->set(symbol("map?"), fn1([](MalType* arg) {
     return boolean(match<MalHash>(arg)); }));
   env->set(symbol("hash-map"), new NativeFn([](MalList* args) {
-    MalHash* hash = new MalHash();
-    for (auto p = args; p != eol; p = p->cdr->cdr)
-      hash = hash->assoc(p->get<HashKey>(0), p->get(1));
-    return hash; }));
+    return MalHash().assoc_many(args); }));
   env->set(symbol("assoc"), new NativeFn([](MalList* args) {
-    auto hash = cast<MalHash>(args->get(0));
-    args = args->cdr;
-    while (args != eol) {
-      auto key = args->get<HashKey>(0);
-      auto value = args->get(1);
-      hash = hash->assoc(key, value);
-      args = args->cdr->cdr;
-    }
-    return hash;
-  }));
+    return cast<MalHash>(args->get(0))->assoc_many(args->cdr); }));
   env->set(symbol("dissoc"), fn2<MalHash, HashKey>([](MalHash* hash, HashKey* key) {
     return hash->dissoc(key);
   }));
@@ -156,13 +156,13 @@ Env* core() {
   env->set(symbol("deref"), fn1<Atom>([](Atom* atom) {
     return atom->ref; }));
   env->set(symbol("reset!"), fn2<Atom, MalType>([](Atom* atom, MalType* newref) {
-    atom->ref = newref;
+    atom->reset(newref);
     return atom->ref; }));
   env->set(symbol("swap!"), new NativeFn([](MalList* args) {
     auto atom = args->get<Atom>(0);
     auto fn = args->get<MalFn>(1);
     auto fnargs = args->cdr->cdr;
-    atom->ref = fn->apply(cons(atom->ref, fnargs));
+    atom->reset(fn->apply(cons(atom->ref, fnargs)));
     return atom->ref; }));
   
   // Comparisons
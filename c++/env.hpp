@@ -9,10 +9,18 @@
 using namespace std;
 
 
-class Env {
+// Bindings are keyed by symbol, which are interned, so finding one hashes
+// a pointer rather than the name.
+//
+// A symbol caches where the global environment keeps its value. Until the
+// symbol is bound in some other frame, a lookup from anywhere ends up
+// there, so it can go straight to the cached value. Builtins and top-level
+// functions are rarely used as local names. Binding a symbol locally, by
+// let*, fn* or def! inside either, switches its cache off for good.
+class Env : public gc::Object {
 public:
   Env(Env* outer_ = nullptr, MalSeq* binds = nullptr, MalList* exprs = nullptr)
-      : outer(outer_) {
+      : outer(outer_), global(outer_ ? outer_->global : this) {
     static MalSymbol* splat = ::symbol("&");
     if (binds) {
       auto q = exprs;
@@ -41,13 +49,16 @@ public:
     }
   }
   void set(MalSymbol* k, MalType* v) {
-    table[k->get_string()] = v;
+    if (outer)
+      k->bound_locally = true;
+    table[k] = v;
+    gc::write_barrier(this);
   }
   Env* find(MalSymbol* k) {
-    if (table.find(k->get_string()) != table.end())
-      return this;
-    else
-      return outer ? outer->find(k) : nullptr;
+    for (Env* env = this; env; env = env->outer)
+      if (env->table.find(k) != env->table.end())
+        return env;
+    return nullptr;
   }
   MalType* get(MalSymbol* k) {
     auto result = lookup(k);
@@ -56,10 +67,25 @@ public:
     return result;
   }
   MalType* lookup(MalSymbol* k) {
-    Env* env = find(k);
-    if (env == nullptr)
-      return nullptr;
-    return env->table[k->get_string()];
+    if (k->global_env == global && !k->bound_locally)
+      return *k->global_value;
+    for (Env* env = this; env; env = env->outer) {
+      auto it = env->table.find(k);
+      if (it != env->table.end()) {
+        // Entries in the table stay where they are as it grows.
+        if (env == global) {
+          k->global_env = global;
+          k->global_value = &it->second;
+        }
+        return it->second;
+      }
+    }
+    return nullptr;
+  }
+  void trace(gc::Tracer& tracer) override {
+    for (auto& binding : table)
+      tracer.mark(binding.second);
+    tracer.mark(outer);
   }
 
 private:
@@ -75,8 +101,9 @@ private:
     return error(err.str());
   }
 
-  std::unordered_map<std::string, MalType*> table;
+  std::unordered_map<MalSymbol*, MalType*> table;
   Env* outer;
+  Env* global;
 };
 
 #endif
\ No newline at end of file
@@ -12,22 +12,28 @@ MalType* eval_ast(MalType* form, Env* env) {
     return keyword;
   if (auto symbol = match<MalSymbol>(form))
     return env->get(symbol);
+  // What has been evaluated so far must stay rooted while the rest is.
   if (auto list = match<MalList>(form)) {
-    return reduce([env](MalType* first, MalList* rest) {
-      return cons(EVAL(first, env), rest); }, list);
+    gc::Root<MalList> values(eol);
+    reduce([env, &values](MalType* first, MalList*) -> MalList* {
+      auto value = EVAL(first, env);
+      values = cons(value, values);
+      return values; }, list);
+    return values;
   }
   if (auto vec = match<MalVector>(form)) {
-    vector<MalType*> v;
+    gc::RootedVector<MalType> values;
     for (auto element : vec->e)
-      v.push_back(EVAL(element, env));
-    return new MalVector(move(v));
+      values.push_back(EVAL(element, env));
+    return new MalVector(values);
   }
   if (auto hash = match<MalHash>(form)) {
-    RBTree<KeyValue> tree;
-    forEach(hash->tree, [&tree, env](const KeyValue& pair) {
-      tree = tree.inserted(KeyValue{pair.key, EVAL(pair.value, env)});
+    gc::Root<MalHash> values(new MalHash());
+    hash->map.for_each([&values, env](const KeyValue& pair) {
+      auto value = EVAL(pair.value, env);
+      values = values->assoc(pair.key, value);
     });
-    return new MalHash(tree);
+    return values;
   }
   return form;
 }
@@ -53,7 +59,8 @@ MalLambda* is_macro_call(MalType* ast, Env* env) {
   return nullptr;
 }
 
-MalType* macroexpand(MalType* ast, Env* env) {
+MalType* macroexpand(MalType* form, Env* env) {
+  gc::Root<MalType> ast(form);
   while (auto lambda = is_macro_call(ast, env)) {
     ast = lambda->apply(cast<MalList>(ast)->cdr);
   }
@@ -66,20 +73,59 @@ bool is_pair(MalType* ast) {
   return false;
 }
 
-MalType* quasiquote(MalType* ast) {
-  static auto _concat = symbol("concat");
-  static auto _cons = symbol("cons");
+// Builds the value of a quasiquoted form straight into a list, rather than
+// rewriting it into calls to cons and concat for EVAL to run. Parts are
+// evaluated left to right. The template must stay rooted by the caller.
+MalType* quasiquote(MalType* ast, Env* env) {
   if (!is_pair(ast))
-    return ::list({_quote, ast});
+    return ast;
   auto seq = cast<MalSeq>(ast);
   if (seq->first() == _unquote)
-    return seq->nth(1);
-  if (auto splice_unquoted = match_wrapped(_splice_unquote, seq->first()))
-    return ::list({_concat, splice_unquoted, quasiquote(seq->rest())});
-  return ::list({_cons, quasiquote(seq->first()), quasiquote(seq->rest())});
+    return EVAL(seq->nth(1), env);
+  vector<MalType*> parts;
+  if (auto vec = match<MalVector>(seq))
+    parts = vec->e;
+  else
+    cast<MalList>(seq)->for_each([&parts](MalType* part) { parts.push_back(part); });
+
+  gc::RootedVector<MalType> items;
+  gc::Root<MalType> tail(eol);
+  for (size_t ii = 0; ii < parts.size(); ii++) {
+    auto part = parts[ii];
+    if (part == _unquote) {
+      // `(a unquote b) is (cons 'a b).
+      if (ii + 1 == parts.size())
+        throw error("Index out of range");
+      tail = EVAL(parts[ii + 1], env);
+      break;
+    }
+    if (auto spliced = match_wrapped(_splice_unquote, part)) {
+      auto value = EVAL(spliced, env);
+      if (auto list = match<MalList>(value))
+        list->for_each([&items](MalType* item) { items.push_back(item); });
+      else if (auto vec = match<MalVector>(value))
+        items.insert(items.end(), vec->e.begin(), vec->e.end());
+      else
+        items.push_back(value);
+    } else {
+      items.push_back(quasiquote(part, env));
+    }
+  }
+
+  MalList* rest = eol;
+  if (auto list = match<MalList>(tail))
+    rest = list;
+  else if (auto vec = match<MalVector>(tail))
+    items.insert(items.end(), vec->e.begin(), vec->e.end());
+  else
+    items.push_back(tail);
+  ListBuilder builder(items.size());
+  for (auto item : items)
+    builder.push_back(item);
+  return builder.build(rest);
 }
 
-MalType* EVAL(MalType* form, Env* env) {
+MalType* EVAL(MalType* form_, Env* env_) {
   static auto _def = symbol("def!");
   static auto _defmacro = symbol("defmacro!");
   static auto _macroexpand = symbol("macroexpand");
@@ -89,7 +135,11 @@ MalType* EVAL(MalType* form, Env* env) {
   static auto _fn = symbol("fn*");
   static auto _try = symbol("try*");
   static auto _catch = symbol("catch*");
+  // Everything the loop holds on to across a call is reachable from these.
+  gc::Root<MalType> form(form_);
+  gc::Root<Env> env(env_);
   while (true) {
+    gc::safepoint();
     form = macroexpand(form, env);
     if (MalList* list = match<MalList>(form)) {
       MalType* head = list->car;
@@ -100,8 +150,12 @@ MalType* EVAL(MalType* form, Env* env) {
         if (symbol == _quote) {
           return rest->get(0);
         } else if (symbol == _quasiquote) {
-          form = quasiquote(rest->get(0));
-          continue;
+          auto tmpl = rest->get(0);
+          if (is_pair(tmpl) && cast<MalSeq>(tmpl)->first() == _unquote) {
+            form = cast<MalSeq>(tmpl)->nth(1);
+            continue;
+          }
+          return quasiquote(tmpl, env);
         } else if (symbol == _unquote) {
           form = rest->get(0);
           continue;
@@ -115,7 +169,7 @@ MalType* EVAL(MalType* form, Env* env) {
         } else if (symbol == _macroexpand) {
           return macroexpand(rest->get(0), env);
         } else if (symbol == _let) {
-          Env* local = new Env(env);
+          gc::Root<Env> local(new Env(env));
           auto bindings = rest->get(0);
           if (auto bindings_vec = match<MalVector>(bindings)) {
             for (int ii=0; ii<bindings_vec->e.size(); ii+=2) {
@@ -176,12 +230,13 @@ MalType* EVAL(MalType* form, Env* env) {
         }
       }
       // Apply
-      list = static_cast<MalList*>(eval_ast(list, env));
-      if (auto f = match<NativeFn>(list->car)) {
-        return f->apply(list->cdr);
-      } else if (auto lambda = match<MalLambda>(list->car)) {
+      // Rooted for the sake of an anonymous NativeFn.
+      gc::Root<MalList> call(static_cast<MalList*>(eval_ast(list, env)));
+      if (auto f = match<NativeFn>(call->car)) {
+        return f->apply(call->cdr);
+      } else if (auto lambda = match<MalLambda>(call->car)) {
         form = lambda->body;
-        env = new Env(lambda->env, lambda->bindings, list->cdr);
+        env = new Env(lambda->env, lambda->bindings, call->cdr);
         continue;
       } else {
         throw error("Expected Function");
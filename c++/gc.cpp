@@ -0,0 +1,324 @@
+#include "gc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+namespace gc {
+
+size_t allocated = 0;
+size_t nursery_size = 1 << 20;
+RootBase* RootBase::top = nullptr;
+
+namespace {
+
+// Cell sizes go up in steps of Granule to MaxSmall, then of BigGranule.
+const size_t Granule = 8;
+const size_t MaxSmall = 1024;
+const size_t BigGranule = 512;
+const size_t MaxCell = 8192;
+const size_t Classes = MaxSmall / Granule + (MaxCell - MaxSmall) / BigGranule + 1;
+const size_t MinMajor = 16 << 20;
+const int Buckets = 24;
+
+typedef chrono::steady_clock Clock;
+
+size_t class_of(size_t size) {
+  if (size <= MaxSmall)
+    return (size + Granule - 1) / Granule;
+  return MaxSmall / Granule + (size - MaxSmall + BigGranule - 1) / BigGranule;
+}
+
+size_t class_size(size_t index) {
+  if (index <= MaxSmall / Granule)
+    return index * Granule;
+  return MaxSmall + (index - MaxSmall / Granule) * BigGranule;
+}
+
+struct SizeClass {
+  void* free;     // cells the last sweep freed, threaded through their first word
+  Chunk* current; // the chunk being bumped through
+};
+
+struct Heap {
+  SizeClass classes[Classes] = {};
+  vector<Chunk*> chunks;
+  vector<Chunk*> large;        // a chunk each, for cells bigger than MaxCell
+  vector<void*> young;         // cells allocated since the last collection
+  vector<Object*> remembered;
+  vector<Object*> mark_stack;
+  char* arena = nullptr;       // chunks not yet used
+  int arena_chunks = 0;
+  size_t old_bytes = 0;
+  size_t next_major = MinMajor;
+
+  bool stats = false;
+  Clock::time_point started = Clock::now();
+  int minors = 0, majors = 0;
+  Clock::duration paused{}, longest{};
+  int histogram[Buckets] = {};
+};
+
+Heap* the_heap = nullptr;
+
+void print_stats();
+
+Heap& heap() {
+  if (!the_heap) {
+    // Never deleted: print_stats runs after static destructors may have.
+    the_heap = new Heap();
+    if (const char* nursery = getenv("MAL_GC_NURSERY"))
+      nursery_size = size_t(atol(nursery)) << 10;
+    if (const char* stats = getenv("MAL_GC_STATS")) {
+      the_heap->stats = *stats && strcmp(stats, "0") != 0;
+      if (the_heap->stats)
+        atexit(print_stats);
+    }
+  }
+  return *the_heap;
+}
+
+void init_chunk(Chunk* chunk, size_t cell_size, size_t cells) {
+  chunk->cell_size = uint32_t(cell_size);
+  chunk->reciprocal = uint32_t(((uint64_t(1) << 32) + cell_size - 1) / cell_size);
+  chunk->cells = uint32_t(cells);
+  chunk->bump = 0;
+  uintptr_t first = reinterpret_cast<uintptr_t>(chunk->state + cells);
+  chunk->first = reinterpret_cast<char*>((first + 15) & ~uintptr_t(15));
+  memset(chunk->state, 0, cells);
+}
+
+Chunk* new_chunk(size_t cell_size) {
+  Heap& h = heap();
+  if (!h.arena_chunks) {
+    // Chunks must be aligned to their size, for Chunk::of. Getting them 32
+    // at a time wastes at most one in 33 to alignment.
+    const int n = 32;
+    char* block = static_cast<char*>(::operator new((n + 1) * Chunk::Size));
+    h.arena = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(block) + Chunk::Size - 1) &
+                                      ~uintptr_t(Chunk::Size - 1));
+    h.arena_chunks = n;
+  }
+  Chunk* chunk = reinterpret_cast<Chunk*>(h.arena);
+  h.arena += Chunk::Size;
+  h.arena_chunks--;
+  size_t header = offsetof(Chunk, state) + 16;
+  init_chunk(chunk, cell_size, (Chunk::Size - header) / (cell_size + 1));
+  h.chunks.push_back(chunk);
+  return chunk;
+}
+
+void* allocate_large(size_t size) {
+  void* memory;
+  if (posix_memalign(&memory, Chunk::Size, offsetof(Chunk, state) + 16 + size))
+    throw bad_alloc();
+  Chunk* chunk = static_cast<Chunk*>(memory);
+  init_chunk(chunk, size, 1);
+  chunk->bump = 1;
+  heap().large.push_back(chunk);
+  return chunk->first;
+}
+
+void* allocate(size_t size, uint8_t kind) {
+  Heap& h = heap();
+  void* p;
+  if (size > MaxCell) {
+    p = allocate_large(size);
+  } else {
+    size_t index = class_of(size);
+    SizeClass& sc = h.classes[index];
+    size = class_size(index);
+    if (sc.free) {
+      p = sc.free;
+      sc.free = *static_cast<void**>(p);
+    } else {
+      Chunk* chunk = sc.current;
+      if (!chunk || chunk->bump == chunk->cells)
+        chunk = sc.current = new_chunk(size);
+      p = chunk->first + size_t(chunk->bump++) * size;
+    }
+  }
+  state_of(p) = Allocated | kind;
+  h.young.push_back(p);
+  allocated += size;
+  return p;
+}
+
+// Runs p's destructor if it has one, and gives its cell back.
+void release(void* p) {
+  Chunk* chunk = Chunk::of(p);
+  uint8_t& state = chunk->state[chunk->index(p)];
+  if ((state & (Allocated | IsArray)) == (Allocated | IsArray)) {
+    Array* array = static_cast<Array*>(p);
+    for (int i = 0; i < array->size(); i++)
+      array->at(i)->~Object();
+  } else if ((state & (Allocated | IsObject)) == (Allocated | IsObject)) {
+    static_cast<Object*>(p)->~Object();
+  }
+  state = 0;
+  if (chunk->cells > 1) {
+    SizeClass& sc = heap().classes[class_of(chunk->cell_size)];
+    *static_cast<void**>(p) = sc.free;
+    sc.free = p;
+  }
+}
+
+void free_large_chunks() {
+  Heap& h = heap();
+  auto dead = partition(h.large.begin(), h.large.end(), [](Chunk* chunk) {
+    return chunk->state[0] != 0;
+  });
+  for (auto it = dead; it != h.large.end(); ++it)
+    free(*it);
+  h.large.erase(dead, h.large.end());
+}
+
+void minor(Tracer& tracer) {
+  Heap& h = heap();
+  for (Object* o : h.remembered) {
+    state_of(o) &= ~Remembered;
+    o->trace(tracer);
+  }
+  h.remembered.clear();
+}
+
+// Sweeps the cells allocated since the last collection; those still
+// unmarked are garbage. The rest are old now.
+void sweep_young() {
+  Heap& h = heap();
+  // Backwards, so that the free lists hand cells out in address order.
+  for (auto it = h.young.rbegin(); it != h.young.rend(); ++it) {
+    void* p = *it;
+    Chunk* chunk = Chunk::of(p);
+    if (chunk->state[chunk->index(p)] & Marked)
+      h.old_bytes += chunk->cell_size;
+    else
+      release(p);
+  }
+  h.young.clear();
+}
+
+void unmark_all() {
+  Heap& h = heap();
+  auto unmark = [](Chunk* chunk) {
+    for (uint32_t i = 0; i < chunk->bump; i++)
+      if (!(chunk->state[i] & Permanent))
+        chunk->state[i] &= ~(Marked | Remembered);
+  };
+  for (Chunk* chunk : h.chunks)
+    unmark(chunk);
+  for (Chunk* chunk : h.large)
+    unmark(chunk);
+  h.remembered.clear();
+}
+
+void sweep_all() {
+  Heap& h = heap();
+  for (auto& sc : h.classes)
+    sc.free = nullptr;
+  h.old_bytes = 0;
+  for (auto it = h.chunks.rbegin(); it != h.chunks.rend(); ++it) {
+    Chunk* chunk = *it;
+    for (uint32_t i = chunk->bump; i-- > 0;) {
+      if (chunk->state[i] & Marked)
+        h.old_bytes += chunk->cell_size;
+      else
+        release(chunk->first + size_t(i) * chunk->cell_size);
+    }
+  }
+  for (Chunk* chunk : h.large) {
+    if (chunk->state[0] & Marked)
+      h.old_bytes += chunk->cell_size;
+    else
+      release(chunk->first);
+  }
+  h.young.clear();
+  h.next_major = max(MinMajor, 2 * h.old_bytes);
+}
+
+void print_stats() {
+  Heap& h = heap();
+  auto ms = [](Clock::duration d) {
+    return chrono::duration<double, milli>(d).count();
+  };
+  double total = ms(Clock::now() - h.started);
+  fprintf(stderr, "gc: %d minor and %d major collections\n", h.minors, h.majors);
+  fprintf(stderr, "gc: paused %.1f ms of %.1f ms (%.1f%%), longest %.2f ms\n",
+          ms(h.paused), total, total > 0 ? 100 * ms(h.paused) / total : 0.0,
+          ms(h.longest));
+  for (int i = 0; i < Buckets; i++)
+    if (h.histogram[i])
+      fprintf(stderr, "gc:   pauses under %8ld us: %d\n", 2L << i, h.histogram[i]);
+  fprintf(stderr, "gc: %zu chunks of %zu KB, %.1f MB old\n",
+          h.chunks.size() + h.large.size(), Chunk::Size >> 10,
+          h.old_bytes / 1048576.0);
+}
+
+} // namespace
+
+void* Object::operator new(size_t size) {
+  return allocate(size, IsObject);
+}
+
+void Object::operator delete(void* p) {
+  // The constructor threw, so the destructor has already run. The cell is
+  // on the young list, so the next sweep frees it.
+  state_of(p) = 0;
+}
+
+void* allocate_raw(size_t size) {
+  return allocate(size, 0);
+}
+
+Array* Array::make(size_t element_size, int capacity) {
+  void* memory = allocate(sizeof(Array) + element_size * capacity, IsArray);
+  Array* array = static_cast<Array*>(memory);
+  array->element_size = uint32_t(element_size);
+  array->count = 0;
+  array->capacity = uint16_t(capacity);
+  return array;
+}
+
+void remember(Object* o) {
+  state_of(o) |= Remembered;
+  heap().remembered.push_back(o);
+}
+
+void collect() {
+  Heap& h = heap();
+  auto start = Clock::now();
+  bool major = h.old_bytes >= h.next_major;
+  if (major)
+    unmark_all();
+
+  Tracer tracer(h.mark_stack);
+  for (RootBase* root = RootBase::top; root; root = root->prev)
+    root->trace(tracer);
+  if (!major)
+    minor(tracer);
+  tracer.drain();
+
+  if (major)
+    sweep_all();
+  else
+    sweep_young();
+  free_large_chunks();
+  allocated = 0;
+
+  auto pause = Clock::now() - start;
+  (major ? h.majors : h.minors)++;
+  h.paused += pause;
+  h.longest = max(h.longest, pause);
+  long us = long(chrono::duration_cast<chrono::microseconds>(pause).count());
+  int bucket = 0;
+  while (bucket < Buckets - 1 && (2L << bucket) <= us)
+    bucket++;
+  h.histogram[bucket]++;
+}
+
+} // namespace gc
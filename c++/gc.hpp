@@ -0,0 +1,233 @@
+// A precise, generational mark-sweep collector for MalType and Env objects,
+// and for the nodes of their hash maps.
+//
+// Memory comes in 64KB chunks, each split into cells of one size. A size
+// class reuses the cells its last sweep freed, and otherwise bumps a pointer
+// through its newest chunk. Each chunk starts with a state byte per cell;
+// objects carry nothing extra.
+//
+// Generations use sticky mark bits: a cell that survives a collection stays
+// marked, and is old from then on. A minor collection marks from the roots
+// and the remembered set, stops at cells that are already marked, and
+// sweeps only the cells allocated since the last collection. An old object
+// changed to point at something must call write_barrier(), which adds it to
+// the remembered set. Once the old generation has doubled, a major
+// collection clears every mark and sweeps every chunk.
+//
+// Collections only happen in safepoint(), which EVAL calls at the top of its
+// loop. Anything a C++ function holds across a call that can reach EVAL must
+// be kept in a Root or a RootedVector, or be reachable from one. Objects
+// never move: NativeFn closures and function-static symbols hold raw
+// pointers that the collector couldn't update.
+//
+// MAL_GC_NURSERY sets how many KB are allocated between collections (0
+// collects at every safepoint). MAL_GC_STATS=1 prints pause times at exit.
+
+#ifndef GC_HPP
+#define GC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gc {
+
+class Tracer;
+
+// Base class of everything allocated with new that the collector manages.
+// It must be the first base of its subclasses, so that an Object* is the
+// address of its cell.
+class Object {
+public:
+  virtual ~Object() { }
+  // Marks each object this one points to.
+  virtual void trace(Tracer&) { }
+
+  static void* operator new(size_t size);
+  // Only called if a constructor throws.
+  static void operator delete(void* p);
+  // For objects in an Array.
+  static void* operator new(size_t, void* p) { return p; }
+  static void operator delete(void*, void*) { }
+};
+
+// Cell state bits.
+enum : uint8_t {
+  Allocated = 1,
+  IsObject = 2, // an Object, not memory from allocate_raw()
+  Marked = 4,
+  Remembered = 8,
+  Permanent = 16,
+  IsArray = 32,
+};
+
+struct Chunk {
+  static const size_t Size = 64 * 1024;
+
+  static Chunk* of(const void* p) {
+    return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(Size - 1));
+  }
+  // Divides by cell_size with a multiply: exact for offsets below Size.
+  uint32_t index(const void* p) const {
+    return uint32_t((uint64_t(static_cast<const char*>(p) - first) * reciprocal) >> 32);
+  }
+
+  uint32_t cell_size;
+  uint32_t reciprocal; // 2^32 / cell_size, rounded up
+  uint32_t cells;
+  uint32_t bump;       // cells from here on have never been handed out
+  char* first;
+  uint8_t state[1];    // really `cells` of them
+};
+
+inline uint8_t& state_of(const void* p) {
+  Chunk* chunk = Chunk::of(p);
+  return chunk->state[chunk->index(p)];
+}
+
+// Objects of one size allocated together, so that they sit next to each
+// other in order. Marking any of them marks them all, and they are freed
+// together.
+class Array {
+public:
+  static Array* make(size_t element_size, int capacity);
+  bool full() const { return count == capacity; }
+  // Where to construct the next object. Call added() once it's there.
+  void* next() { return at(count); }
+  void added() { count++; }
+  int size() const { return count; }
+  Object* at(int i) {
+    return reinterpret_cast<Object*>(reinterpret_cast<char*>(this + 1) + size_t(i) * element_size);
+  }
+  static Array* containing(const void* p) {
+    Chunk* chunk = Chunk::of(p);
+    return reinterpret_cast<Array*>(chunk->first + size_t(chunk->index(p)) * chunk->cell_size);
+  }
+
+private:
+  uint32_t element_size;
+  uint16_t count;
+  uint16_t capacity;
+};
+
+// Memory the collector frees when nothing marks it, without running any
+// destructor.
+void* allocate_raw(size_t size);
+
+// An allocator for HAMT nodes.
+struct Raw {
+  static void* allocate(size_t size) { return allocate_raw(size); }
+};
+
+// Keeps o forever. Only for objects that point to nothing, such as
+// interned symbols.
+template <typename T>
+T* permanent(T* o) {
+  state_of(o) |= Marked | Permanent;
+  return o;
+}
+
+class Tracer {
+public:
+  void mark(Object* o) {
+    if (!o)
+      return;
+    uint8_t& state = state_of(o);
+    if (state & Marked)
+      return;
+    state |= Marked;
+    if (state & IsArray) {
+      Array* array = Array::containing(o);
+      for (int i = 0; i < array->size(); i++)
+        stack.push_back(array->at(i));
+    } else {
+      stack.push_back(o);
+    }
+  }
+  // True the first time, when the caller should go on to mark what p
+  // points to.
+  bool mark_raw(const void* p) {
+    uint8_t& state = state_of(p);
+    if (state & Marked)
+      return false;
+    state |= Marked;
+    return true;
+  }
+
+private:
+  explicit Tracer(std::vector<Object*>& stack_) : stack(stack_) { }
+  void drain() {
+    while (!stack.empty()) {
+      Object* o = stack.back();
+      stack.pop_back();
+      o->trace(*this);
+    }
+  }
+  std::vector<Object*>& stack;
+  friend void collect();
+};
+
+// The shadow stack: Roots link themselves in while they're in scope.
+class RootBase {
+public:
+  RootBase(const RootBase&) = delete;
+  RootBase& operator=(const RootBase&) = delete;
+
+protected:
+  RootBase() : prev(top) { top = this; }
+  ~RootBase() { top = prev; }
+
+private:
+  virtual void trace(Tracer&) = 0;
+  RootBase* prev;
+  static RootBase* top;
+  friend void collect();
+};
+
+// A local pointer the collector can see.
+template <typename T>
+class Root : public RootBase {
+public:
+  explicit Root(T* ptr_ = nullptr) : ptr(ptr_) { }
+  Root& operator=(T* p) { ptr = p; return *this; }
+  Root& operator=(const Root& other) { ptr = other.ptr; return *this; }
+  operator T*() const { return ptr; }
+  T* operator->() const { return ptr; }
+  T* get() const { return ptr; }
+
+private:
+  void trace(Tracer& tracer) override { tracer.mark(ptr); }
+  T* ptr;
+};
+
+template <typename T>
+class RootedVector : public RootBase, public std::vector<T*> {
+private:
+  void trace(Tracer& tracer) override {
+    for (T* p : *this)
+      tracer.mark(p);
+  }
+};
+
+// Bytes allocated since the last collection, and how many to allow.
+extern size_t allocated;
+extern size_t nursery_size;
+
+void collect();
+
+inline void safepoint() {
+  if (allocated >= nursery_size)
+    collect();
+}
+
+void remember(Object* o);
+
+// Call after storing a pointer into o.
+inline void write_barrier(Object* o) {
+  if ((state_of(o) & (Marked | Remembered)) == Marked)
+    remember(o);
+}
+
+} // namespace gc
+
+#endif
@@ -2,8 +2,6 @@
 
 #include <regex>
 #include <vector>
-#include <memory>
-#include <iostream>
 
 #include "types.hpp"
 
@@ -11,40 +9,95 @@ using namespace std;
 
 MalType* read_form(Reader& reader);
 
-bool Reader::done() const {
-  return index >= tokens.size();
+bool Reader::done() {
+  scan();
+  return token.empty();
 }
 
-const string& Reader::peek() const {
-    if (done())
-      throw error("Parse error");
-    return tokens[index];
+const string& Reader::peek() {
+  if (done())
+    throw error("Parse error");
+  return token;
 }
 
 string Reader::next() {
-  return move(tokens[index++]);
+  peek();
+  scanned = false;
+  return move(token);
 }
 
+static bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+    c == '\r' || c == ',';
+}
 
-vector<string> tokenizer(string s) {
-  static regex re(R"/([\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"|;.*|[^\s\[\]{}('"`,;)]*))/");
-                                                                                 
-  vector<string> tokens;
-  smatch match;
-  while (!s.empty() && regex_search(s, match, re)) {
-    if (match.empty())
-      break;
-    string token = match[1];
-    if (token.empty())
+static bool is_line_end(char c) {
+  return c == '\n' || c == '\r';
+}
+
+static bool is_special(char c) {
+  switch (c) {
+  case '[': case ']': case '{': case '}': case '(': case ')':
+  case '\'': case '`': case '~': case '^': case '@':
+    return true;
+  }
+  return false;
+}
+
+static bool is_symbol_char(char c) {
+  switch (c) {
+  case '[': case ']': case '{': case '}': case '(': case ')':
+  case '\'': case '"': case '`': case ',': case ';':
+    return false;
+  }
+  return !is_space(c);
+}
+
+// Scan the next token into `token`, matching the old tokenizer regex:
+//   [\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"|;.*|[^\s\[\]{}('"`,;)]*)
+// Comments are skipped. An empty token means end of input, which is also
+// what an unterminated string turns into.
+void Reader::scan() {
+  if (scanned)
+    return;
+  scanned = true;
+  token.clear();
+  auto end = input.end();
+  while (true) {
+    while (pos != end && is_space(*pos))
+      ++pos;
+    if (pos == end)
+      return;
+    if (*pos != ';')
       break;
-    //cout << "token: [" << token << "]\n";
-    if (token[0] != ';') {
-      tokens.push_back(token);
+    while (pos != end && !is_line_end(*pos))
+      ++pos;
+  }
+  auto start = pos;
+  if (*pos == '~' && pos + 1 != end && pos[1] == '@') {
+    pos += 2;
+  } else if (is_special(*pos)) {
+    ++pos;
+  } else if (*pos == '"') {
+    auto p = pos + 1;
+    while (true) {
+      if (p == end)
+        return;
+      if (*p == '"')
+        break;
+      if (*p == '\\') {
+        if (p + 1 == end || is_line_end(p[1]))
+          return;
+        ++p;
+      }
+      ++p;
     }
-    //cout << "suffix: [" << match.suffix() << "]\n";
-    s = match.suffix();
+    pos = p + 1;
+  } else {
+    while (pos != end && is_symbol_char(*pos))
+      ++pos;
   }
-  return tokens;
+  token.assign(start, pos);
 }
 
 MalType* read_atom(Reader& reader) {
@@ -117,11 +170,11 @@ MalType* read_form(Reader& reader) {
     
 MalType* read_list(Reader& reader) {
   reader.next(); // "("
-  vector<MalType*> e;
+  ListBuilder list;
   while (reader.peek()[0] != ')')
-    e.push_back(read_form(reader));
+    list.push_back(read_form(reader));
   reader.next(); // ")"
-  return to_list(new MalVector(move(e)));
+  return list.build();
 }
 
 MalType* read_vector(Reader& reader) {
@@ -135,15 +188,18 @@ MalType* read_vector(Reader& reader) {
 
 MalType* read_hash(Reader& reader) {
   reader.next(); // "{"
-  MalHash* hash = new MalHash();
-  while (reader.peek()[0] != '}')
-    hash = hash->assoc(cast<HashKey>(read_form(reader)), read_form(reader));
+  HashMap::Transient map;
+  while (reader.peek()[0] != '}') {
+    // Read the key before the value; argument evaluation order is unspecified.
+    auto key = cast<HashKey>(read_form(reader));
+    map.assoc(KeyValue{key, read_form(reader)});
+  }
   reader.next(); // "}"
-  return hash;
+  return new MalHash(map.persistent());
 }
 
 Reader::Reader(string s)
-  : tokens(tokenizer(s)), index(0)
+  : input(move(s)), pos(input.begin()), scanned(false)
 { }
 
 MalType* read_str(string s) {
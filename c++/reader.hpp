@@ -1,23 +1,29 @@
 #ifndef READER_HPP
 #define READER_HPP
 
-#include <regex>
-#include <vector>
-#include <memory>
+#include <string>
 
 #include "types.hpp"
 
+// Tokens are scanned lazily from the input, one at a time, so reading a
+// form is linear in the size of the input.
 class Reader {
 public:
   Reader(std::string s);
-  bool done() const;
-  const std::string& peek() const;
+  Reader(const Reader&) = delete;
+  Reader& operator=(const Reader&) = delete;
+  bool done();
+  const std::string& peek();
   std::string next();
 private:
-  std::vector<std::string> tokens;
-  int index;
+  void scan();
+
+  const std::string input;
+  std::string::const_iterator pos;
+  std::string token;
+  bool scanned;
 };
 
 MalType* read_str(std::string s);
 
-#endif
\ No newline at end of file
+#endif
@@ -21,10 +21,11 @@ string rep(string s, Env* env) {
 }
 
 int main(int argc, char* argv[]) {
-  Env* repl_env = core();
+  gc::Root<Env> repl_env(core());
   rep("(def! *host-language* \"c++\")", repl_env);
   rep("(def! not (fn* (a) (if a false true)))", repl_env);
-  repl_env->set(symbol("eval"), fn1([repl_env](MalType* form) { return EVAL(form, repl_env); }));
+  Env* env = repl_env;
+  repl_env->set(symbol("eval"), fn1([env](MalType* form) { return EVAL(form, env); }));
   rep("(def! load-file (fn* (f) (eval (read-string (str \"(do \" (slurp f) \")\")))))", repl_env);
   rep("(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))", repl_env);
   rep("(defmacro! or (fn* (& xs) (if (empty? xs) nil (if (= 1 (count xs)) (first xs) `(let* (or_FIXME ~(first xs)) (if or_FIXME or_FIXME (or ~@(rest xs))))))))", repl_env);
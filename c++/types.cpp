@@ -1,5 +1,6 @@
 #include "types.hpp"
 
+#include <algorithm>
 #include <sstream>
 #include <regex>
 #include <unordered_map>
@@ -41,10 +42,10 @@ MalSeq* MalVector::rest() {
     return to_list(this)->cdr;
 }
 
-MalList* eol = new MalList(nullptr, nullptr);
-MalNil* nil = new MalNil();
-MalTrue* _true = new MalTrue();
-MalFalse* _false = new MalFalse();
+MalList* eol = gc::permanent(new MalList(nullptr, nullptr));
+MalNil* nil = gc::permanent(new MalNil());
+MalTrue* _true = gc::permanent(new MalTrue());
+MalFalse* _false = gc::permanent(new MalFalse());
 
 string MalList::print(bool print_readably) const {
   stringstream s;
@@ -60,11 +61,24 @@ string MalList::print(bool print_readably) const {
   return s.str();
 }
 
-int MalList::size() {
-  int s = 0;
-  for (MalList* p=this; p != eol; p=p->cdr)
-    s++;
-  return s;
+MalList* ListBuilder::build(MalList* rest) {
+  if (!head)
+    return rest;
+  tail->cdr = rest;
+  int length = count + rest->length;
+  MalList* p = head;
+  while (p != rest) {
+    // Find the cells from p on that are consecutive in one block...
+    int cells = 1;
+    for (auto q = p; q->cdr != rest && q->cdr == q + 1; q = q->cdr)
+      cells++;
+    // ...then record the lengths and runs for them.
+    for (int ii = cells - 1; ii >= 0; ii--, p = p->cdr) {
+      p->run = ii;
+      p->length = length--;
+    }
+  }
+  return head;
 }
 
 bool MalList::equal_impl(MalType* other_obj) const {
@@ -75,21 +89,27 @@ bool MalList::equal_impl(MalType* other_obj) const {
 }
 
 MalList* concat2(MalList* a, MalList* b) {
-  if (a == eol)
-    return b;
-  return cons(a->car, concat2(a->cdr, b));
+  ListBuilder builder;
+  for (auto p = a; p != eol; p = p->cdr)
+    builder.push_back(p->car);
+  return builder.build(b);
 }
 
 MalList* concat(MalList* sequences) {
-  if (sequences == eol)
-    return eol;
-  auto first = sequences->car;
-  auto rest = sequences->cdr;
-  if (auto list = match<MalList>(first))
-    return concat2(list, concat(rest));
-  if (auto vec = match<MalVector>(first))
-    return concat2(to_list(vec), concat(rest));
-  return cons(first, concat(rest));
+  ListBuilder builder;
+  for (auto p = sequences; p != eol; p = p->cdr) {
+    if (auto list = match<MalList>(p->car)) {
+      // The last list needn't be copied.
+      if (p->cdr == eol)
+        return builder.build(list);
+      list->for_each([&builder](MalType* item) { builder.push_back(item); });
+    } else if (auto vec = match<MalVector>(p->car)) {
+      for (auto item : vec->e)
+        builder.push_back(item);
+    } else
+      builder.push_back(p->car);
+  }
+  return builder.build();
 }
 
 string Atom::print(bool print_readably) const {
@@ -99,55 +119,65 @@ string Atom::print(bool print_readably) const {
 }
 
 string MalHash::print(bool print_readably) const {
+  // Print in key order, so the output doesn't depend on the keys' hashes.
+  vector<KeyValue> pairs;
+  pairs.reserve(map.size());
+  map.for_each([&pairs](const KeyValue& pair) { pairs.push_back(pair); });
+  sort(pairs.begin(), pairs.end(), [](const KeyValue& a, const KeyValue& b) {
+    if (a.key->get_string() != b.key->get_string())
+      return a.key->get_string() < b.key->get_string();
+    return typeid(*a.key).hash_code() < typeid(*b.key).hash_code();
+  });
+
   stringstream s;
   s << '{';
   int ii = 0;
-  forEach(tree, [&](const KeyValue& pair) {
+  for (const auto& pair : pairs) {
     if (ii++)
       s << ' ';
     s << pair.key->print(print_readably) << ' ' << pair.value->print(print_readably);
-  });
+  }
   s << '}';
   return s.str();
 }
 
+void MalHash::trace(gc::Tracer& tracer) {
+  map.visit([&tracer](const void* node) { return tracer.mark_raw(node); },
+            [&tracer](const KeyValue& kv) {
+              tracer.mark(kv.key);
+              tracer.mark(kv.value);
+            });
+  trace_meta(tracer);
+}
+
 MalHash* MalHash::assoc(HashKey* key, MalType* value) {
-  return new MalHash(tree.inserted(KeyValue{key, value}));
+  return new MalHash(map.assoc(KeyValue{key, value}));
+}
+
+MalHash* MalHash::assoc_many(MalList* pairs) {
+  HashMap::Transient newmap(map);
+  for (auto p = pairs; p != eol; p = p->cdr->cdr)
+    newmap.assoc(KeyValue{p->get<HashKey>(0), p->get(1)});
+  return new MalHash(newmap.persistent());
 }
 
 MalHash* MalHash::dissoc(HashKey* key) {
-  // TODO: Implement delete properly, or find a real HAMT impl.
-  RBTree<KeyValue> newtree;
-  forEach(tree, [&key, &newtree](const KeyValue& kv) {
-    if (!equal(kv.key, key))
-      newtree = newtree.inserted(kv);
-  });
-  return new MalHash(newtree);
+  return new MalHash(map.dissoc(KeyValue{key, nullptr}));
 }
 
 MalHash* MalHash::dissoc_many(MalList* keys) {
   for (auto p = keys; p != eol; p = p->cdr)
     if (!match<HashKey>(p->car))
       throw error("Expected String or Symbol or Keyword, got " + p->car->print());
-  // TODO: Implement delete properly, or find a real HAMT impl.
-  RBTree<KeyValue> newtree;
-  forEach(tree, [&keys, &newtree](const KeyValue& kv) {
-    bool to_delete = false;
-    for (auto p = keys; p != eol; p = p->cdr) {
-      if (equal(kv.key, p->car)) {
-        to_delete = true;
-        break;
-      }
-    }
-    if (!to_delete)
-      newtree = newtree.inserted(kv);
-  });
-  return new MalHash(newtree);
+  HashMap newmap = map;
+  for (auto p = keys; p != eol; p = p->cdr)
+    newmap = newmap.dissoc(KeyValue{static_cast<HashKey*>(p->car), nullptr});
+  return new MalHash(newmap);
 }
 
 MalList* MalHash::keys() {
   MalList* keys = eol;
-  forEach(tree, [&keys](const KeyValue& kv) {
+  map.for_each([&keys](const KeyValue& kv) {
     keys = cons(kv.key, keys);
   });
   return keys;
@@ -155,19 +185,27 @@ MalList* MalHash::keys() {
 
 MalList* MalHash::values() {
   MalList* values = eol;
-  forEach(tree, [&values](const KeyValue& kv) {
+  map.for_each([&values](const KeyValue& kv) {
     values = cons(kv.value, values);
   });
   return values;
 }
 
 bool MalHash::contains(HashKey* key) {
-  return tree.member(KeyValue{key, nullptr});
+  return map.find(KeyValue{key, nullptr}) != nullptr;
 }
 
 MalType* MalHash::get(HashKey* key) {
-  auto kv = tree.find(KeyValue{key, nullptr});
-  return kv.key ? kv.value : nil;
+  auto kv = map.find(KeyValue{key, nullptr});
+  return kv ? kv->value : nil;
+}
+
+uint32_t HashKey::hash_string(const std::string& s) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (unsigned char c : s)
+    hash = (hash ^ c) * 16777619u;
+  return hash;
 }
 
 string Number::print(bool) const {
@@ -186,6 +224,7 @@ string MalSymbol::print(bool) const {
 }
 
 MalSymbol::MalSymbol(std::string s_) : s(std::move(s_)) {
+  key_hash = hash_string(s);
 }
 
 MalSymbol* symbol(const string& s) {
@@ -193,7 +232,7 @@ MalSymbol* symbol(const string& s) {
   auto it = table.find(s);
   if (it != table.end())
     return it->second;
-  auto sym = new MalSymbol(s);
+  auto sym = gc::permanent(new MalSymbol(s));
   table[s] = sym;
   return sym;
 }
@@ -203,10 +242,10 @@ MalSymbol* _unquote = symbol("unquote");
 MalSymbol* _splice_unquote = symbol("splice-unquote");
 
 MalSymbol* gensym() {
-  static MalList* gensyms = eol;
-  auto newsym = new MalSymbol("");
+  // Permanent, since its name comes from its address.
+  auto newsym = gc::permanent(new MalSymbol(""));
   newsym->s = newsym->print();
-  gensyms = cons(newsym, gensyms);
+  newsym->key_hash = MalSymbol::hash_string(newsym->s);
   return newsym;
 }
 
@@ -217,6 +256,7 @@ string MalKeyword::print(bool) const {
 MalKeyword::MalKeyword(std::string s_) : s(std::move(s_)) {
   if (s.empty())
     throw error("Empty string can't be converted to Keyword");
+  key_hash = hash_string(s);
 }
 
 MalKeyword* keyword(const string& s) {
@@ -224,7 +264,7 @@ MalKeyword* keyword(const string& s) {
   auto it = table.find(s);
   if (it != table.end())
     return it->second;
-  auto k = new MalKeyword(s);
+  auto k = gc::permanent(new MalKeyword(s));
   table[s] = k;
   return k;
 }
@@ -258,6 +298,18 @@ string MalLambda::print(bool) const {
   return is_macro ? "#<macro>" : "#<lambda>";
 }
 
+MalType* NativeFn::apply(MalList* args) {
+  gc::Root<MalList> rooted(args);
+  return f(args);
+}
+
+void MalLambda::trace(gc::Tracer& tracer) {
+  tracer.mark(bindings);
+  tracer.mark(body);
+  tracer.mark(env);
+  trace_meta(tracer);
+}
+
 MalType* MalLambda::apply(MalList* args) {
   auto exec_env = new Env(env, bindings, args);
   return EVAL(body, exec_env);
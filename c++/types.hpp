@@ -1,12 +1,15 @@
 #ifndef TYPES_HPP
 #define TYPES_HPP
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <functional>
+#include <new>
 #include <string>
 
-#include "RBTree.h"
+#include "HAMT.h"
+#include "gc.hpp"
 
 class MalType;
 class MalList;
@@ -21,9 +24,8 @@ template <typename T> T* cast(MalType* form);
 
 bool equal(MalType* a, MalType* b);
 
-class MalType {
+class MalType : public gc::Object {
 public:
-  virtual ~MalType() { }
   virtual std::string print(bool print_readably = true) const = 0;
 private:
   // Implementations of equal_impl may safely static_cast to their own type.
@@ -44,6 +46,9 @@ public:
     return newobj;
   }
 
+protected:
+  void trace_meta(gc::Tracer& tracer) { tracer.mark(metadata); }
+
 private:
   MalType* metadata;
 };
@@ -80,6 +85,17 @@ inline MalType* boolean(bool b) {
 class HashKey : public MalType {
 public:
   virtual const std::string& get_string() = 0;
+  // Hash of get_string(), for MalHash. Symbols and keywords are interned,
+  // so they work it out once when they're made; strings on first use.
+  uint32_t hash() {
+    if (!key_hash)
+      key_hash = hash_string(get_string());
+    return key_hash;
+  }
+
+protected:
+  static uint32_t hash_string(const std::string& s);
+  uint32_t key_hash = 0;
 };
 
 class MalSymbol : public HashKey {
@@ -91,6 +107,12 @@ public:
   std::string print(bool print_readably = true) const override;
   const std::string& get_string() override { return s; }
 
+  // For Env's lookups: where global_env keeps this symbol's value, and
+  // whether any other frame has bound it.
+  Env* global_env = nullptr;
+  MalType** global_value = nullptr;
+  bool bound_locally = false;
+
 private:
   std::string s;
 };
@@ -159,8 +181,9 @@ public:
   NativeFn(F f_) : f(std::move(f_)) { }
   bool equal_impl(MalType*) const override { return false; }
   std::string print(bool print_readably = true) const override;
-  MalType* apply(MalList* args) override { return f(args); }
+  MalType* apply(MalList* args) override;
   Meta* copy() override { return new NativeFn(f); }
+  void trace(gc::Tracer& tracer) override { trace_meta(tracer); }
 
 private:
   const std::function<MalType*(MalList*)> f;
@@ -174,6 +197,7 @@ public:
   std::string print(bool print_readably = true) const override;
   MalType* apply(MalList* args) override;
   Meta* copy() override { return new MalLambda(bindings, body, env, is_macro); }
+  void trace(gc::Tracer& tracer) override;
   
   MalSeq* bindings;
   MalType* body;
@@ -221,7 +245,8 @@ extern MalList* eol;
 // Meta is on every list node, which is a bit wasteful.
 class MalList : public MalSeq, public Meta {
 public:
-  MalList(MalType* car_, MalList* cdr_) : car(car_), cdr(cdr_) { }
+  MalList(MalType* car_, MalList* cdr_)
+    : car(car_), cdr(cdr_), length(cdr_ ? cdr_->length + 1 : 0), run(0) { }
   bool equal_impl(MalType*) const override;
   std::string print(bool print_readably = true) const override;
   bool empty() override { return this == eol; }
@@ -230,18 +255,66 @@ public:
   MalSeq* rest() override { if (empty()) return eol; return cdr; }
   MalType* nth(int n) override { return get(n); }
   Meta* copy() override { return new MalList(car, cdr); }
+  void trace(gc::Tracer& tracer) override {
+    tracer.mark(car);
+    tracer.mark(cdr);
+    trace_meta(tracer);
+  }
   template <typename T = MalType> T* get(int ii);
-  int size();
+  int size() { return length; }
   template <typename F> void for_each(F&& f);
   
   MalType* const car;
-  MalList* const cdr;
+  // Not const only so that ListBuilder can link up cells nothing else has
+  // seen yet. Lists are immutable once built.
+  MalList* cdr;
+  int length;
+  // How many of the following cells are next to this one in memory, in
+  // order, so that get() can jump straight to them.
+  int run;
 };
 
 inline MalList* cons(MalType* first, MalList* rest) {
   return new MalList(first, rest);
 }
 
+// Builds a list front to back by appending to the last cell. Cells are
+// allocated in blocks and filled in order, which makes the list an
+// unrolled one: get() steps through a block by pointer arithmetic. Call
+// build() once, when done.
+class ListBuilder {
+public:
+  // If the number of items is known, the first block holds exactly that.
+  explicit ListBuilder(int expected = 0)
+    : next_block_size(expected > 0 ? std::min(expected, 128) : 4) { }
+
+  void push_back(MalType* item) {
+    if (!block || block->full()) {
+      // Blocks double, up to a point, so that a long list wastes at most
+      // part of its last block, and one live cell keeps few others alive.
+      block = gc::Array::make(sizeof(MalList), next_block_size);
+      next_block_size = std::min(2 * next_block_size, 128);
+    }
+    auto cell = new (block->next()) MalList(item, eol);
+    block->added();
+    if (tail)
+      tail->cdr = cell;
+    else
+      head = cell;
+    tail = cell;
+    count++;
+  }
+  // Ends the list with rest, which is shared rather than copied.
+  MalList* build(MalList* rest = eol);
+
+private:
+  MalList* head = nullptr;
+  MalList* tail = nullptr;
+  int count = 0;
+  gc::Array* block = nullptr;
+  int next_block_size;
+};
+
 // Concatenate a list of sequences.
 MalList* concat(MalList* lists);
 
@@ -250,11 +323,19 @@ MalList* concat2(MalList* a, MalList* b);
 
 template <typename T>
 T* MalList::get(int ii) {
-  MalList* p = this;
-  while (ii-- > 0 && p != eol)
-    p = p->cdr;
-  if (p == eol)
+  if (ii >= length)
     throw error("Index out of range");
+  MalList* p = this;
+  while (ii > 0) {
+    if (p->run) {
+      int step = std::min(ii, p->run);
+      p += step;
+      ii -= step;
+    } else {
+      p = p->cdr;
+      ii--;
+    }
+  }
   return cast<T>(p->car);
 }
 
@@ -287,6 +368,11 @@ public:
   MalSeq* rest() override;
   MalType* nth(int n) override { return get(n); }
   Meta* copy() override { return new MalVector(e); }
+  void trace(gc::Tracer& tracer) override {
+    for (auto item : e)
+      tracer.mark(item);
+    trace_meta(tracer);
+  }
   template <typename T = MalType>
   T* get(int ii) {
     if (ii >= e.size())
@@ -309,10 +395,10 @@ public:
 };
 
 inline MalList* to_list(MalVector* vec) {
-  MalList* list = eol;
-  for (auto iter = vec->e.rbegin(); iter != vec->e.rend(); ++iter)
-    list = cons(*iter, list);
-  return list;
+  ListBuilder builder(vec->e.size());
+  for (auto item : vec->e)
+    builder.push_back(item);
+  return builder.build();
 }
 
 inline MalVector* to_vector(MalList* list) {
@@ -323,8 +409,10 @@ inline MalVector* to_vector(MalList* list) {
 }
 
 inline MalList* list(std::initializer_list<MalType*> init) {
-  std::vector<MalType*> vec(init);
-  return to_list(new MalVector(vec));
+  ListBuilder builder(init.size());
+  for (auto item : init)
+    builder.push_back(item);
+  return builder.build();
 }
 
 inline MalVector* cdr(MalVector* list) {
@@ -349,28 +437,28 @@ MalVector* reduce(F&& f, MalVector* vec, MalType* base) {
 // Hash
 
 struct KeyValue {
-  HashKey* key; // Internally, key=nullptr is a sentinel in RBTree::find().
-                // I should have used RBMap.
+  HashKey* key;
   MalType* value;
-  
-  bool operator<(const KeyValue& other) const {
-    if (key == other.key)
-      return false;
-    if (key->get_string() != other.key->get_string())
-      return key->get_string() < other.key->get_string();
-    // Unstable type comparison
-    return typeid(*key).hash_code() < typeid(*other.key).hash_code();
+
+  uint32_t hash() const { return key->hash(); }
+  bool same_key(const KeyValue& other) const {
+    return key == other.key || equal(key, other.key);
   }
 };
 
+typedef HAMT<KeyValue, gc::Raw> HashMap;
+
 class MalHash : public MalType, public Meta {
 public:
   MalHash() { };
-  MalHash(RBTree<KeyValue> tree_) : tree(std::move(tree_)) { }
+  MalHash(HashMap map_) : map(std::move(map_)) { }
   bool equal_impl(MalType*) const override { throw error("Unimplemented"); }
   std::string print(bool) const override;
-  Meta* copy() override { return new MalHash(tree); }
+  Meta* copy() override { return new MalHash(map); }
+  void trace(gc::Tracer& tracer) override;
   MalHash* assoc(HashKey* key, MalType* value);
+  // Adds key/value pairs, from a list of alternating keys and values.
+  MalHash* assoc_many(MalList* pairs);
   MalHash* dissoc(HashKey* key);
   MalHash* dissoc_many(MalList* keys);
   MalType* get(HashKey* key);
@@ -378,7 +466,7 @@ public:
   MalList* keys();
   MalList* values();
   
-  const RBTree<KeyValue> tree;
+  const HashMap map;
 };
 
 // Atom
@@ -388,7 +476,12 @@ public:
   Atom(MalType* ref_) : ref(ref_) { }
   bool equal_impl(MalType*) const override { return false; }
   std::string print(bool) const override;
-  
+  void reset(MalType* ref_) {
+    ref = ref_;
+    gc::write_barrier(this);
+  }
+  void trace(gc::Tracer& tracer) override { tracer.mark(ref); }
+
   MalType* ref;
 };
 
@@ -0,0 +1,26 @@
+#include "ArgStack.h"
+
+#include <memory>
+
+static std::vector<std::unique_ptr<malValueVec>> chunks;
+
+const int malArgStack::ChunkSize;
+
+malArgStack::State malArgStack::s_state = { -1, malValueIter(), malValueIter() };
+
+void malArgStack::nextChunk(int count)
+{
+    // Any chunks above the current one are unused, so one which is too
+    // small for this frame can simply be replaced.
+    int chunk = s_state.chunk + 1;
+    if (chunk == (int)chunks.size()) {
+        chunks.emplace_back();
+    }
+    if (!chunks[chunk] || ((int)chunks[chunk]->size() < count)) {
+        chunks[chunk].reset(new malValueVec(std::max<int>(ChunkSize, count)));
+    }
+
+    s_state.chunk = chunk;
+    s_state.top   = chunks[chunk]->begin();
+    s_state.limit = chunks[chunk]->end();
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_ARGSTACK_H
+#define INCLUDE_ARGSTACK_H
+
+#include "Types.h"
+
+#include <algorithm>
+
+// The interpreter's argument stack. A function application evaluates its
+// operator and arguments into a frame on this stack and passes them on as
+// an iterator range, instead of allocating a malValueVec for every call.
+//
+// The stack is made of chunks which are never resized, so a frame's
+// iterators stay valid while nested calls push frames above it. A frame
+// which doesn't fit in the rest of the current chunk starts the next one.
+// Chunks are kept once allocated, so a warmed-up stack doesn't touch the
+// heap at all.
+class malArgStack {
+    struct State {
+        int          chunk;
+        malValueIter top;
+        malValueIter limit;
+    };
+
+public:
+    // Frames must be strictly nested; declaring them as locals does that,
+    // and also unwinds them when an exception passes through.
+    class Frame {
+    public:
+        Frame(int count) : m_saved(s_state) {
+            if (s_state.limit - s_state.top < count) {
+                nextChunk(count);
+            }
+            m_begin = s_state.top;
+            m_end   = m_begin + count;
+            s_state.top = m_end;
+        }
+
+        ~Frame() {
+            // Drop the references now, not when the slots are next reused.
+            std::fill(m_begin, m_end, malValuePtr());
+            s_state = m_saved;
+        }
+
+        malValueIter begin() const { return m_begin; }
+        malValueIter end()   const { return m_end;   }
+
+        malValuePtr& operator [] (int index) const { return m_begin[index]; }
+
+    private:
+        Frame(const Frame&);
+        Frame& operator=(const Frame&);
+
+        const State  m_saved;
+        malValueIter m_begin;
+        malValueIter m_end;
+    };
+
+private:
+    static const int ChunkSize = 1024;
+
+    static void nextChunk(int count);
+
+    static State s_state;
+};
+
+#endif // INCLUDE_ARGSTACK_H
@@ -0,0 +1,263 @@
+#include "BigInt.h"
+#include "Validation.h"
+
+#include <algorithm>
+#include <ctype.h>
+
+BigInt::BigInt(int64_t value)
+: m_negative(value < 0)
+{
+    // Work with the magnitude as unsigned, so that INT64_MIN is safe.
+    uint64_t magnitude = m_negative ? 0 - static_cast<uint64_t>(value)
+                                    : static_cast<uint64_t>(value);
+    while (magnitude != 0) {
+        m_digits.push_back(magnitude % Base);
+        magnitude /= Base;
+    }
+}
+
+BigInt BigInt::parse(const String& token)
+{
+    BigInt result;
+    auto begin = token.begin();
+    if ((begin != token.end()) && ((*begin == '-') || (*begin == '+'))) {
+        result.m_negative = (*begin == '-');
+        ++begin;
+    }
+    MAL_CHECK(begin != token.end(), "Invalid integer %s", token.c_str());
+
+    // Take nine decimal digits at a time, from the least significant end.
+    for (auto end = token.end(); end != begin; ) {
+        auto start = (end - begin > 9) ? end - 9 : begin;
+        uint32_t digit = 0;
+        for (auto it = start; it != end; ++it) {
+            MAL_CHECK(isdigit(*it), "Invalid integer %s", token.c_str());
+            digit = digit * 10 + (*it - '0');
+        }
+        result.m_digits.push_back(digit);
+        end = start;
+    }
+    trim(result.m_digits);
+    result.m_negative = result.m_negative && !result.isZero();
+    return result;
+}
+
+bool BigInt::toInt64(int64_t& value) const
+{
+    uint64_t magnitude = 0;
+    for (auto it = m_digits.rbegin(), end = m_digits.rend(); it != end; ++it) {
+        if (__builtin_mul_overflow(magnitude, Base, &magnitude) ||
+            __builtin_add_overflow(magnitude, *it, &magnitude)) {
+            return false;
+        }
+    }
+    const uint64_t limit = static_cast<uint64_t>(INT64_MAX);
+    if (magnitude > limit + (m_negative ? 1 : 0)) {
+        return false;
+    }
+    value = m_negative ? static_cast<int64_t>(0 - magnitude)
+                       : static_cast<int64_t>(magnitude);
+    return true;
+}
+
+String BigInt::toString() const
+{
+    if (isZero()) {
+        return "0";
+    }
+    String out = m_negative ? "-" : "";
+    out += std::to_string(m_digits.back());
+    for (int i = m_digits.size() - 2; i >= 0; i--) {
+        out += STRF("%09u", m_digits[i]);
+    }
+    return out;
+}
+
+BigInt BigInt::operator - () const
+{
+    BigInt result(*this);
+    result.m_negative = !m_negative && !isZero();
+    return result;
+}
+
+BigInt BigInt::addSigned(const BigInt& lhs, const BigInt& rhs, bool negateRhs)
+{
+    bool rhsNegative = rhs.m_negative != negateRhs;
+    BigInt result(lhs);
+    if (lhs.m_negative == rhsNegative) {
+        add(result.m_digits, rhs.m_digits);
+    }
+    else if (compare(lhs.m_digits, rhs.m_digits) >= 0) {
+        subtract(result.m_digits, rhs.m_digits);
+    }
+    else {
+        result.m_digits = rhs.m_digits;
+        result.m_negative = rhsNegative;
+        subtract(result.m_digits, lhs.m_digits);
+    }
+    result.m_negative = result.m_negative && !result.isZero();
+    return result;
+}
+
+BigInt operator + (const BigInt& lhs, const BigInt& rhs)
+{
+    return BigInt::addSigned(lhs, rhs, false);
+}
+
+BigInt operator - (const BigInt& lhs, const BigInt& rhs)
+{
+    return BigInt::addSigned(lhs, rhs, true);
+}
+
+BigInt operator * (const BigInt& lhs, const BigInt& rhs)
+{
+    BigInt result;
+    result.m_digits = BigInt::multiply(lhs.m_digits, rhs.m_digits);
+    result.m_negative = (lhs.m_negative != rhs.m_negative) && !result.isZero();
+    return result;
+}
+
+BigInt operator / (const BigInt& lhs, const BigInt& rhs)
+{
+    BigInt quotient, remainder;
+    BigInt::divide(lhs.m_digits, rhs.m_digits,
+                   quotient.m_digits, remainder.m_digits);
+    quotient.m_negative = (lhs.m_negative != rhs.m_negative)
+                       && !quotient.isZero();
+    return quotient;
+}
+
+BigInt operator % (const BigInt& lhs, const BigInt& rhs)
+{
+    BigInt quotient, remainder;
+    BigInt::divide(lhs.m_digits, rhs.m_digits,
+                   quotient.m_digits, remainder.m_digits);
+    remainder.m_negative = lhs.m_negative && !remainder.isZero();
+    return remainder;
+}
+
+bool operator == (const BigInt& lhs, const BigInt& rhs)
+{
+    return (lhs.m_negative == rhs.m_negative)
+        && (lhs.m_digits == rhs.m_digits);
+}
+
+bool operator <= (const BigInt& lhs, const BigInt& rhs)
+{
+    if (lhs.m_negative != rhs.m_negative) {
+        return lhs.m_negative;
+    }
+    int cmp = BigInt::compare(lhs.m_digits, rhs.m_digits);
+    return lhs.m_negative ? cmp >= 0 : cmp <= 0;
+}
+
+int BigInt::compare(const Digits& lhs, const Digits& rhs)
+{
+    if (lhs.size() != rhs.size()) {
+        return lhs.size() < rhs.size() ? -1 : 1;
+    }
+    for (int i = lhs.size() - 1; i >= 0; i--) {
+        if (lhs[i] != rhs[i]) {
+            return lhs[i] < rhs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+void BigInt::add(Digits& lhs, const Digits& rhs)
+{
+    if (lhs.size() < rhs.size()) {
+        lhs.resize(rhs.size(), 0);
+    }
+    uint32_t carry = 0;
+    for (size_t i = 0; i < lhs.size(); i++) {
+        uint32_t sum = lhs[i] + carry + (i < rhs.size() ? rhs[i] : 0);
+        carry = sum >= Base;
+        lhs[i] = carry ? sum - Base : sum;
+        if (!carry && (i >= rhs.size())) {
+            break;
+        }
+    }
+    if (carry) {
+        lhs.push_back(carry);
+    }
+}
+
+// Requires lhs >= rhs.
+void BigInt::subtract(Digits& lhs, const Digits& rhs)
+{
+    int32_t borrow = 0;
+    for (size_t i = 0; i < lhs.size(); i++) {
+        int32_t diff = int32_t(lhs[i]) - borrow
+                     - int32_t(i < rhs.size() ? rhs[i] : 0);
+        borrow = diff < 0;
+        lhs[i] = borrow ? diff + Base : diff;
+        if (!borrow && (i >= rhs.size())) {
+            break;
+        }
+    }
+    trim(lhs);
+}
+
+BigInt::Digits BigInt::multiply(const Digits& lhs, const Digits& rhs)
+{
+    if (lhs.empty() || rhs.empty()) {
+        return Digits();
+    }
+    std::vector<uint64_t> acc(lhs.size() + rhs.size(), 0);
+    for (size_t i = 0; i < lhs.size(); i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < rhs.size(); j++) {
+            uint64_t cur = acc[i + j] + uint64_t(lhs[i]) * rhs[j] + carry;
+            acc[i + j] = cur % Base;
+            carry = cur / Base;
+        }
+        for (size_t k = i + rhs.size(); carry != 0; k++) {
+            uint64_t cur = acc[k] + carry;
+            acc[k] = cur % Base;
+            carry = cur / Base;
+        }
+    }
+    Digits result(acc.begin(), acc.end());
+    trim(result);
+    return result;
+}
+
+// Schoolbook long division, one base 10^9 digit at a time. Each quotient
+// digit is found by binary search, which is slow but simple, and bignums
+// are expected to be rare.
+void BigInt::divide(const Digits& lhs, const Digits& rhs,
+                    Digits& quotient, Digits& remainder)
+{
+    MAL_CHECK(!rhs.empty(), "Division by zero");
+
+    quotient.assign(lhs.size(), 0);
+    remainder.clear();
+    for (int i = lhs.size() - 1; i >= 0; i--) {
+        remainder.insert(remainder.begin(), lhs[i]);
+        trim(remainder);
+
+        uint32_t low = 0, high = Base - 1;
+        while (low < high) {
+            uint32_t mid = low + (high - low + 1) / 2;
+            if (compare(multiply(rhs, Digits(1, mid)), remainder) <= 0) {
+                low = mid;
+            }
+            else {
+                high = mid - 1;
+            }
+        }
+        if (low != 0) {
+            subtract(remainder, multiply(rhs, Digits(1, low)));
+        }
+        quotient[i] = low;
+    }
+    trim(quotient);
+}
+
+void BigInt::trim(Digits& digits)
+{
+    while (!digits.empty() && (digits.back() == 0)) {
+        digits.pop_back();
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_BIGINT_H
+#define INCLUDE_BIGINT_H
+
+#include "String.h"
+
+#include <stdint.h>
+#include <vector>
+
+// An arbitrary precision integer, used when 64-bit arithmetic would
+// overflow. Division truncates towards zero, and the remainder takes the
+// sign of the dividend, just as for int64_t.
+class BigInt {
+public:
+    BigInt() : m_negative(false) { }
+    BigInt(int64_t value);
+
+    static BigInt parse(const String& token);
+
+    bool isZero() const { return m_digits.empty(); }
+
+    // Returns false if the value doesn't fit.
+    bool toInt64(int64_t& value) const;
+
+    String toString() const;
+
+    BigInt operator - () const;
+
+    friend BigInt operator + (const BigInt& lhs, const BigInt& rhs);
+    friend BigInt operator - (const BigInt& lhs, const BigInt& rhs);
+    friend BigInt operator * (const BigInt& lhs, const BigInt& rhs);
+    friend BigInt operator / (const BigInt& lhs, const BigInt& rhs);
+    friend BigInt operator % (const BigInt& lhs, const BigInt& rhs);
+
+    friend bool operator == (const BigInt& lhs, const BigInt& rhs);
+    friend bool operator <= (const BigInt& lhs, const BigInt& rhs);
+
+private:
+    // Digits are base 10^9, least significant first, with no leading zeros.
+    typedef std::vector<uint32_t> Digits;
+    static const uint32_t Base = 1000000000;
+
+    static int  compare(const Digits& lhs, const Digits& rhs);
+    static void add(Digits& lhs, const Digits& rhs);
+    static void subtract(Digits& lhs, const Digits& rhs);
+    static void divide(const Digits& lhs, const Digits& rhs,
+                       Digits& quotient, Digits& remainder);
+    static Digits multiply(const Digits& lhs, const Digits& rhs);
+    static void trim(Digits& digits);
+
+    static BigInt addSigned(const BigInt& lhs, const BigInt& rhs,
+                            bool negateRhs);
+
+    bool   m_negative;
+    Digits m_digits;
+};
+
+#endif // INCLUDE_BIGINT_H
@@ -0,0 +1,351 @@
+#include "Bytecode.h"
+#include "ArgStack.h"
+#include "Environment.h"
+
+struct malCode::State {
+    malCode*           code;
+    const Instruction* pc;
+    malValueIter       regs;
+    malEnvPtr          env;
+    malValuePtr        result;
+    malValuePtr        callee;  // keeps the code alive after a tail call
+};
+
+malCode::malCode(const malSymbolVec& params)
+: malValue(CODE)
+, m_params(params)
+, m_registers(1)
+, m_epoch(0)
+{
+
+}
+
+malCode::malCode(const malCode& that, malValuePtr meta)
+: malValue(CODE, meta)
+, m_params(that.m_params)
+, m_code(that.m_code)
+, m_constants(that.m_constants)
+, m_globals(that.m_globals)
+, m_registers(that.m_registers)
+, m_source(that.m_source)
+, m_epoch(that.m_epoch)
+, m_recompiled(that.m_recompiled)
+{
+    if (that.isTraced()) {
+        markTraced();
+    }
+}
+
+void malCode::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    for (auto& constant : m_constants) {
+        visitor.visit(constant);
+    }
+    visitor.visit(m_source);
+    visitor.visit(m_recompiled);
+}
+
+int malCode::emit(Op op, int a, int b, int c)
+{
+    Instruction instruction;
+    instruction.op = op;
+    instruction.a  = a;
+    instruction.b  = b;
+    instruction.c  = c;
+    m_code.push_back(instruction);
+    return m_code.size() - 1;
+}
+
+int malCode::constant(malValuePtr value)
+{
+    m_constants.push_back(value);
+    return m_constants.size() - 1;
+}
+
+int malCode::global(const malSymbol* symbol)
+{
+    Global global = { symbol->interned(), NULL, NULL };
+    m_globals.push_back(global);
+    return m_globals.size() - 1;
+}
+
+void malCode::useRegisters(int count)
+{
+    m_registers = std::max(m_registers, count);
+}
+
+void malCode::setSource(malValuePtr body, unsigned epoch)
+{
+    m_source = body;
+    m_epoch  = epoch;
+}
+
+void malCode::finish()
+{
+    // Quoted code can hold anything, closures included.
+    for (auto& constant : m_constants) {
+        if (isTracedValue(constant)) {
+            markTraced();
+            break;
+        }
+    }
+    if (isTracedValue(m_source)) {
+        markTraced();
+    }
+}
+
+malCode* malCode::current(malEnvRef env)
+{
+    unsigned epoch = malAnalysedList::macroEpoch();
+    if (!m_source || (m_epoch == epoch)) {
+        return this;
+    }
+    // The frame stands in for the closure's environment, as the parameters
+    // are all it adds.
+    malCode* code = STATIC_CAST(malCode, m_recompiled);
+    if (!code || (code->m_epoch != epoch)) {
+        m_recompiled = compileBody(m_params, m_source, env);
+        code = STATIC_CAST(malCode, m_recompiled);
+        if (code->isTraced()) {
+            markTraced();
+        }
+    }
+    return code;
+}
+
+malValuePtr malCode::run(malEnvPtr env)
+{
+    State state;
+    state.code = current(env);
+    state.env  = std::move(env);
+    // A call further in can compile the body again, replacing the code
+    // which is running here.
+    state.callee = state.code;
+    while (1) {
+        RefCounted::collectCyclesIfDue();
+
+        malArgStack::Frame registers(state.code->m_registers);
+        state.regs = registers.begin();
+        state.pc   = state.code->m_code.data();
+        if (execute(state) == RETURNED) {
+            return std::move(state.result);
+        }
+        // A tail call: state now has the callee's code and frame.
+    }
+}
+
+// Runs the code until it returns or makes a tail call. Each try* is run by
+// a nested call, so that C++ exception handling is only set up while there
+// is a handler.
+malCode::Stop malCode::execute(State& state)
+{
+    while (1) {
+        Stop stop = dispatch(state);
+        if (stop != ENTERED_TRY) {
+            return stop;
+        }
+
+        const Instruction& handler = state.pc[-1];
+        const Instruction* program = state.code->m_code.data();
+        int reg = handler.a;
+        const Instruction* catchBlock = program + handler.b;
+        const Instruction* end = program + handler.c;
+        malEnvPtr env = state.env;
+        malValuePtr exception;
+        try {
+            stop = execute(state);
+            if (stop != LEFT_TRY) {
+                return stop;
+            }
+            continue;
+        }
+        catch (String& s) {
+            exception = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            state.env = env;
+            state.regs[reg] = mal::nilValue();
+            state.pc = end;
+            continue;
+        }
+        catch (malValuePtr& o) {
+            exception = o;
+        };
+        state.env = env;
+        state.regs[reg] = exception;
+        state.pc = catchBlock;
+    }
+}
+
+malCode::Stop malCode::dispatch(State& state)
+{
+    malCode* code = state.code;
+    const Instruction* program = code->m_code.data();
+    const Instruction* pc = state.pc;
+    const malValuePtr* constants = code->m_constants.data();
+    malValueIter regs = state.regs;
+    malEnvPtr& env = state.env;
+
+    while (1) {
+        const Instruction& in = *pc++;
+        switch (in.op) {
+            case CONST:
+                regs[in.a] = constants[in.b];
+                break;
+
+            case MOVE:
+                regs[in.a] = regs[in.b];
+                break;
+
+            case LOCAL:
+                regs[in.a] = env->get(in.b, in.c);
+                break;
+
+            case GLOBAL: {
+                malEnv* frame = env->frame(in.b);
+                Global& global = code->m_globals[in.c];
+                if (frame == global.env) {
+                    regs[in.a] = *global.value;
+                }
+                else if (malValuePtr* value = frame->globalValue(global.symbol)) {
+                    global.env   = frame;
+                    global.value = value;
+                    regs[in.a] = *value;
+                }
+                else {
+                    regs[in.a] = frame->get(global.symbol);
+                }
+                break;
+            }
+
+            case JUMP:
+                pc = program + in.b;
+                break;
+
+            case JUMP_IF_FALSE:
+                if (!regs[in.a]->isTrue()) {
+                    pc = program + in.b;
+                }
+                break;
+
+            case CLOSURE: {
+                malValueRef body = constants[in.b];
+                regs[in.a] = mal::lambda(STATIC_CAST(malCode, body)->params(),
+                                         body, env);
+                break;
+            }
+
+            case DEF:
+                regs[in.a] = define(STATIC_CAST(malSymbol, constants[in.b]),
+                                    regs[in.a], env);
+                break;
+
+            case DEFMACRO: {
+                const malLambda* lambda = VALUE_CAST(malLambda, regs[in.a]);
+                regs[in.a] = define(STATIC_CAST(malSymbol, constants[in.b]),
+                                    mal::macro(*lambda), env);
+                break;
+            }
+
+            case PUSH_ENV:
+                env = malEnvPtr(new malEnv(env));
+                break;
+
+            case POP_ENV:
+                env = env->outer();
+                break;
+
+            case BIND:
+                env->set(STATIC_CAST(malSymbol, constants[in.b]), regs[in.a]);
+                break;
+
+            case MACRO_CHECK: {
+                // The operator was defined as a macro after this code was
+                // compiled, so the form is expanded and compiled now.
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, regs[in.a]);
+                if (lambda && lambda->isMacro()) {
+                    regs[in.a] = EVAL(constants[in.b], env);
+                    pc = program + in.c;
+                }
+                break;
+            }
+
+            case CALL: {
+                malValueIter args = regs + in.a + 1;
+                malValueRef op = regs[in.a];
+                malValuePtr result;
+                if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+                    malValuePtr body = lambda->getBody();
+                    malEnvPtr frame = lambda->makeEnv(args, args + in.b);
+                    if (malCode* callee = DYNAMIC_CAST(malCode, body)) {
+                        result = callee->run(std::move(frame));
+                    }
+                    else {
+                        result = EVAL(body, frame);
+                    }
+                }
+                else {
+                    result = APPLY(op, args, args + in.b, env);
+                }
+                regs[in.a] = std::move(result);
+                break;
+            }
+
+            case TAIL_CALL: {
+                malValueIter args = regs + in.a + 1;
+                malValueRef op = regs[in.a];
+                const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+                if (!lambda) {
+                    state.result = APPLY(op, args, args + in.b, env);
+                    return RETURNED;
+                }
+                malValuePtr body = lambda->getBody();
+                env = lambda->makeEnv(args, args + in.b);
+                if (!DYNAMIC_CAST(malCode, body)) {
+                    state.result = EVAL(body, env);
+                    return RETURNED;
+                }
+                state.code = STATIC_CAST(malCode, body)->current(env);
+                state.callee = state.code;
+                return TAIL_CALLED;
+            }
+
+            case RETURN:
+                state.result = std::move(regs[in.a]);
+                return RETURNED;
+
+            case MAKE_VECTOR:
+                regs[in.a] = mal::vector(regs + in.a, regs + in.a + in.b);
+                break;
+
+            case MAKE_HASH:
+                regs[in.a] = mal::hash(regs + in.a, regs + in.a + in.b, true);
+                break;
+
+            case QUASIQUOTE:
+                regs[in.a] = STATIC_CAST(malTemplate, constants[in.b])
+                                 ->build(regs + in.a);
+                break;
+
+            case MACROEXPAND:
+                regs[in.a] = macroExpand(constants[in.b], env);
+                break;
+
+            case TRY:
+                state.pc = pc;
+                return ENTERED_TRY;
+
+            case END_TRY:
+                state.pc = pc;
+                return LEFT_TRY;
+
+            case THROW:
+                if (in.a == 0) {
+                    throw STATIC_CAST(malString, constants[in.b])->value();
+                }
+                throw malValuePtr(constants[in.b]);
+        }
+    }
+}
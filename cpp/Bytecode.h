@@ -0,0 +1,136 @@
+#ifndef INCLUDE_BYTECODE_H
+#define INCLUDE_BYTECODE_H
+
+#include "MAL.h"
+#include "Types.h"
+
+#include <cstdint>
+#include <vector>
+
+// Code compiled from a form, and the loop which runs it. The compiler is
+// in stepA_mal.cpp, alongside the analyser.
+//
+// The machine has registers, which live on the argument stack, so that a
+// call's operator and arguments are evaluated into consecutive registers
+// and passed on from there. Variables live in malEnv frames as they do for
+// EVAL, so that compiled closures, builtins and eval can share them. The
+// compiler resolves each local to a frame depth and slot; other names are
+// looked up from a frame depth at run time, and a name found in the global
+// environment is cached as a pointer to its value there.
+//
+// A fn* compiles to a malCode of its own, which becomes the body of the
+// closures made from it, so that applying one runs its code. Its macro calls
+// are expanded as it's compiled, so like an analysed list the code is only
+// good while the macros stay as they were. After that, calls run the body
+// compiled again instead.
+class malCode : public malValue {
+public:
+    TAGS(CODE, CODE);
+
+    enum Op : uint8_t {
+        CONST,        // a = k b, the constant numbered b
+        MOVE,         // a = b, both registers
+        LOCAL,        // a = slot c of the frame b out
+        GLOBAL,       // a = the value of globals[c], from the frame b out
+        JUMP,         // to b
+        JUMP_IF_FALSE,// to b, if a is false or nil
+        CLOSURE,      // a = a closure of the code in k b
+        DEF,          // binds symbol k b to a, in the current frame
+        DEFMACRO,     // as DEF, binding a macro made from the closure in a
+        PUSH_ENV,     // starts a new frame
+        POP_ENV,      // goes back to the frame's outer one
+        BIND,         // binds symbol k b to a, in the current frame
+        MACRO_CHECK,  // if a is a macro, a = EVAL of form k b; to c
+        CALL,         // a = a applied to the b registers after it
+        TAIL_CALL,    // returns a applied to the b registers after it
+        RETURN,       // returns a
+        MAKE_VECTOR,  // a = a vector of the b registers from a
+        MAKE_HASH,    // a = a hash of the b registers from a, keys first
+        QUASIQUOTE,   // a = the list template k b builds from registers a on
+        MACROEXPAND,  // a = form k b, macroexpanded
+        TRY,          // on an exception, a = it and go to b; c is the end
+        END_TRY,      // drops the innermost handler
+        THROW,        // throws k b, as a string if a is zero
+    };
+
+    struct Instruction {
+        uint32_t op : 8;
+        uint32_t a  : 24;
+        int32_t  b;
+        int32_t  c;
+    };
+
+    malCode(const malSymbolVec& params);
+    malCode(const malCode& that, malValuePtr meta);
+
+    // The code is run in the frame env, usually the one a call made for
+    // the code's parameters.
+    malValuePtr run(malEnvPtr env);
+
+    // The code to run for a call whose frame is env: this, or if the macros
+    // have changed since it was compiled, its body compiled again.
+    malCode* current(malEnvRef env);
+
+    virtual malValuePtr eval(malEnvRef env) { return run(env); }
+
+    virtual String print(bool readably) const {
+        return STRF("#code(%p)", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual void visitChildren(Visitor& visitor) const;
+
+    WITH_META(malCode);
+
+    const malSymbolVec& params() const { return m_params; }
+
+    // For the compiler.
+    int emit(Op op, int a = 0, int b = 0, int c = 0);
+    int here() const { return m_code.size(); }
+    Instruction& instruction(int index) { return m_code[index]; }
+    // Drops the instructions from index on.
+    void truncate(int index) { m_code.resize(index); }
+    int constant(malValuePtr value);
+    int global(const malSymbol* symbol);
+    void useRegisters(int count);
+    // For a fn* body, which is compiled again if the macros change.
+    void setSource(malValuePtr body, unsigned epoch);
+    // Called once the code is complete.
+    void finish();
+
+private:
+    // Why dispatch() stopped.
+    enum Stop { RETURNED, TAIL_CALLED, ENTERED_TRY, LEFT_TRY };
+
+    struct State;
+    static Stop execute(State& state);
+    static Stop dispatch(State& state);
+
+    struct Global {
+        const malSymbol* symbol;
+        // Where the symbol was last found, if that was the global frame.
+        const malEnv*    env;
+        malValuePtr*     value;
+    };
+
+    const malSymbolVec       m_params;
+    std::vector<Instruction> m_code;
+    malValueVec              m_constants;
+    std::vector<Global>      m_globals;
+    int                      m_registers;
+    malValuePtr              m_source;
+    unsigned                 m_epoch;
+    malValuePtr              m_recompiled;
+};
+
+// stepA_mal.cpp
+extern malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+extern malValuePtr define(const malSymbol* id, malValuePtr value,
+                          malEnvPtr env);
+extern malValuePtr compileBody(const malSymbolVec& params, malValuePtr body,
+                               malEnvPtr env);
+
+#endif // INCLUDE_BYTECODE_H
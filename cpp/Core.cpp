@@ -1,4 +1,5 @@
 #include "MAL.h"
+#include "ArgStack.h"
 #include "Environment.h"
 #include "StaticList.h"
 #include "Types.h"
@@ -25,6 +26,7 @@ static String printValues(malValueIter begin, malValueIter end,
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define INT_ARG(name)   int64_t name = toInteger(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -33,10 +35,54 @@ static StaticList<malBuiltIn*> handlers;
     static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
         (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
-        malValueIter argsBegin, malValueIter argsEnd, malEnvPtr env)
+        malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
 
 #define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
 
+// The general handlers for builtins which have handlers taking their one or
+// two arguments directly, for APPLY and the VM. Only EVAL calls the direct
+// ones itself, when a call has the right number of arguments.
+template<malBuiltIn::UnaryFunc* unary>
+static malValuePtr applyUnary(const String& name,
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
+{
+    CHECK_ARGS_IS(1);
+    return unary(argsBegin[0]);
+}
+
+template<malBuiltIn::BinaryFunc* binary>
+static malValuePtr applyBinary(const String& name,
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
+{
+    CHECK_ARGS_IS(2);
+    return binary(argsBegin[0], argsBegin[1]);
+}
+
+template<malBuiltIn::UnaryFunc* unary, malBuiltIn::BinaryFunc* binary>
+static malValuePtr applyUnaryOrBinary(const String& name,
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    if (argCount == 1) {
+        return unary(argsBegin[0]);
+    }
+    return binary(argsBegin[0], argsBegin[1]);
+}
+
+#define BUILTIN_FIXED_DEF(uniq, symbol, handler, unary, binary) \
+    static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
+        (handlers, new malBuiltIn(symbol, handler, unary, binary))
+
+#define BUILTIN_UNARY(symbol, unary) \
+    BUILTIN_FIXED_DEF(__LINE__, symbol, applyUnary<unary>, unary, NULL)
+
+#define BUILTIN_BINARY(symbol, binary) \
+    BUILTIN_FIXED_DEF(__LINE__, symbol, applyBinary<binary>, NULL, binary)
+
+#define BUILTIN_UNARY_OR_BINARY(symbol, unary, binary) \
+    BUILTIN_FIXED_DEF(__LINE__, symbol, \
+        (applyUnaryOrBinary<unary, binary>), unary, binary)
+
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
         CHECK_ARGS_IS(1); \
@@ -49,16 +95,57 @@ static StaticList<malBuiltIn*> handlers;
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
-        CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
-        if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+// Arithmetic is done on int64_t when both arguments fit, and the
+// overflows() check says whether the result does. If not, it's redone
+// with bignums, and the result is normalised back to an int64_t if it can
+// be.
+#define BUILTIN_INTOP(op, uniq, overflows) \
+    static malValuePtr FUNCNAME(uniq)(malValueRef lhs, malValueRef rhs) { \
+        int64_t lhsValue, rhsValue, result; \
+        if (malValuePtr::areIntegers(lhs, rhs)) { \
+            if (!overflows(lhs.integerValue(), rhs.integerValue(), &result)) { \
+                return mal::integer(result); \
+            } \
+        } \
+        else if (isInt64(lhs, lhsValue) && isInt64(rhs, rhsValue) && \
+                 !overflows(lhsValue, rhsValue, &result)) { \
+            return mal::integer(result); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(toBigInt(lhs) op toBigInt(rhs)); \
+    } \
+    BUILTIN_BINARY(#op, FUNCNAME(uniq))
+
+static bool addOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    return __builtin_add_overflow(lhs, rhs, result);
+}
+
+static bool subOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    return __builtin_sub_overflow(lhs, rhs, result);
+}
+
+static bool mulOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    return __builtin_mul_overflow(lhs, rhs, result);
+}
+
+static bool divOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    MAL_CHECK(rhs != 0, "Division by zero");
+    if ((lhs == INT64_MIN) && (rhs == -1)) {
+        return true;
     }
+    *result = lhs / rhs;
+    return false;
+}
+
+static bool modOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    MAL_CHECK(rhs != 0, "Division by zero");
+    *result = (rhs == -1) ? 0 : lhs % rhs;
+    return false;
+}
 
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("keyword?",     malKeyword);
@@ -68,58 +155,84 @@ BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
 
-BUILTIN_INTOP(+,            false);
-BUILTIN_INTOP(/,            true);
-BUILTIN_INTOP(*,            false);
-BUILTIN_INTOP(%,            true);
+BUILTIN_INTOP(+, Add,       addOverflows);
+BUILTIN_INTOP(/, Divide,    divOverflows);
+BUILTIN_INTOP(*, Multiply,  mulOverflows);
+BUILTIN_INTOP(%, Modulo,    modOverflows);
 
 BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
+static malValuePtr builtInNegate(malValueRef arg)
 {
-    int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
-    if (argCount == 1) {
-        return mal::integer(- lhs->value());
+    int64_t value;
+    if (isInt64(arg, value) && (value != INT64_MIN)) {
+        return mal::integer(- value);
     }
-
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    return mal::integer(- toBigInt(arg));
 }
 
-BUILTIN("<=")
+static malValuePtr builtInSubtract(malValueRef lhs, malValueRef rhs)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
-
-    return mal::boolean(lhs->value() <= rhs->value());
+    int64_t lhsValue, rhsValue, result;
+    if (malValuePtr::areIntegers(lhs, rhs)) {
+        // Neither can be big enough to overflow.
+        return mal::integer(lhs.integerValue() - rhs.integerValue());
+    }
+    if (isInt64(lhs, lhsValue) && isInt64(rhs, rhsValue) &&
+            !subOverflows(lhsValue, rhsValue, &result)) {
+        return mal::integer(result);
+    }
+    return mal::integer(toBigInt(lhs) - toBigInt(rhs));
 }
 
-BUILTIN("=")
+BUILTIN_UNARY_OR_BINARY("-", builtInNegate, builtInSubtract);
+
+static malValuePtr builtInLessOrEqual(malValueRef lhs, malValueRef rhs)
 {
-    CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    int64_t lhsValue, rhsValue;
+    if (malValuePtr::areIntegers(lhs, rhs)) {
+        return mal::boolean(lhs.integerValue() <= rhs.integerValue());
+    }
+    if (isInt64(lhs, lhsValue) && isInt64(rhs, rhsValue)) {
+        return mal::boolean(lhsValue <= rhsValue);
+    }
+    return mal::boolean(toBigInt(lhs) <= toBigInt(rhs));
+}
+
+BUILTIN_BINARY("<=", builtInLessOrEqual);
 
+static malValuePtr builtInEqual(malValueRef lhs, malValueRef rhs)
+{
+    // Integers which fit in a malValuePtr are only ever held there.
+    if (malValuePtr::areIntegers(lhs, rhs) || (lhs == rhs)) {
+        return mal::boolean(lhs == rhs);
+    }
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+BUILTIN_BINARY("=", builtInEqual);
+
+#ifdef MAL_ALLOC_STATS
+BUILTIN("alloc-count")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(allocationCount());
+}
+#endif
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
     malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
-
-    // Then append the argument as a list.
+    // Copy the first N-1 arguments in, then the elements of the last one.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    int fixedCount = std::distance(argsBegin, argsEnd-1);
+    malArgStack::Frame args(fixedCount + lastArg->count());
+    std::copy(argsBegin, argsEnd-1, args.begin());
+    std::copy(lastArg->begin(), lastArg->end(), args.begin() + fixedCount);
 
     return APPLY(op, args.begin(), args.end(), env->getRoot());
 }
@@ -189,17 +302,19 @@ BUILTIN("contains?")
     return mal::boolean(hash->contains(*argsBegin));
 }
 
-BUILTIN("count")
+static malValuePtr builtInCount(malValueRef arg)
 {
-    CHECK_ARGS_IS(1);
-    if (*argsBegin == mal::nilValue()) {
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
+        return mal::integer(seq->count());
+    }
+    if (arg == mal::nilValue()) {
         return mal::integer(0);
     }
-
-    ARG(malSequence, seq);
-    return mal::integer(seq->count());
+    return mal::integer(VALUE_CAST(malSequence, arg)->count());
 }
 
+BUILTIN_UNARY("count", builtInCount);
+
 BUILTIN("deref")
 {
     CHECK_ARGS_IS(1);
@@ -230,11 +345,18 @@ BUILTIN("eval")
     return EVAL(*argsBegin, env->getRoot());
 }
 
-BUILTIN("first")
+static malValuePtr builtInFirst(malValueRef arg)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malSequence, seq);
-    return seq->first();
+    return VALUE_CAST(malSequence, arg)->first();
+}
+
+BUILTIN_UNARY("first", builtInFirst);
+
+// Collects cyclic garbage now, returning how many objects it found.
+BUILTIN("gc")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(RefCounted::collectCycles());
 }
 
 BUILTIN("get")
@@ -274,18 +396,71 @@ BUILTIN("meta")
     return obj->meta();
 }
 
-BUILTIN("nth")
+static malValuePtr builtInNth(malValueRef sequence, malValueRef index)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    const malSequence* seq = VALUE_CAST(malSequence, sequence);
+    int64_t i = toInteger(index);
 
-    int i = index->value();
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
 }
 
+BUILTIN_BINARY("nth", builtInNth);
+
+// A map per size class the pool has used, saying how many blocks are live
+// now, the most there have been, how many have been allocated, and how
+// many slabs the class holds and has given back.
+BUILTIN("pool-stats")
+{
+    CHECK_ARGS_IS(0);
+    Pool::Stats stats[Pool::Classes];
+    int count = Pool::stats(stats);
+
+    malValueVec* items = new malValueVec(count);
+    for (int i = 0; i < count; i++) {
+        const Pool::Stats& s = stats[i];
+        malValueVec fields {
+            mal::keyword(":size"),     mal::integer(s.size),
+            mal::keyword(":live"),     mal::integer(s.live),
+            mal::keyword(":peak"),     mal::integer(s.peak),
+            mal::keyword(":allocs"),   mal::integer(s.allocated),
+            mal::keyword(":slabs"),    mal::integer(s.slabs),
+            mal::keyword(":released"), mal::integer(s.released),
+        };
+        items->at(i) = mal::hash(fields.begin(), fields.end(), true);
+    }
+    return mal::list(items);
+}
+
+// A map from each kind of object which has been made, such as :integer or
+// :env, to how many are alive now and the most there have been at once.
+// The counts are taken before any of the map is made.
+BUILTIN("object-stats")
+{
+    CHECK_ARGS_IS(0);
+    LiveCount counts[malValue::Tags + 1];
+    for (int i = 0; i < malValue::Tags; i++) {
+        counts[i] = malValue::liveCount(static_cast<malValue::Tag>(i));
+    }
+    counts[malValue::Tags] = malEnv::liveCount();
+
+    malValueVec items;
+    for (int i = 0; i <= malValue::Tags; i++) {
+        if (counts[i].peak != 0) {
+            const char* name = (i < malValue::Tags)
+                ? malValue::tagName(static_cast<malValue::Tag>(i)) : "env";
+            malValueVec fields {
+                mal::keyword(":live"), mal::integer(counts[i].live),
+                mal::keyword(":peak"), mal::integer(counts[i].peak),
+            };
+            items.push_back(mal::keyword(String(":") + name));
+            items.push_back(mal::hash(fields.begin(), fields.end(), true));
+        }
+    }
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -326,13 +501,13 @@ BUILTIN("reset!")
     return atom->reset(*argsBegin);
 }
 
-BUILTIN("rest")
+static malValuePtr builtInRest(malValueRef arg)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malSequence, seq);
-    return seq->rest();
+    return VALUE_CAST(malSequence, arg)->rest();
 }
 
+BUILTIN_UNARY("rest", builtInRest);
+
 BUILTIN("slurp")
 {
     CHECK_ARGS_IS(1);
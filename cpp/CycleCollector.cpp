@@ -0,0 +1,243 @@
+#include "RefCountedPtr.h"
+
+#include <algorithm>
+#include <vector>
+
+// Roots are traced objects which have had a reference dropped and still
+// have others. Each one is garbage if all of those come from cycles. An
+// object which is destroyed is removed from the roots, leaving a NULL.
+// Never freed, as objects may be released during static destruction.
+static std::vector<const RefCounted*>& roots =
+    *new std::vector<const RefCounted*>;
+
+// A collection is due once there are this many roots, or as many as the
+// objects the last collection traced, if that is more. So the work of a
+// collection is paid for by the releases which noted the roots.
+static const size_t MinRoots = 10000;
+static size_t rootLimit = MinRoots;
+
+// The NULLs left in the roots by destroyed objects. Without collections
+// (the earlier steps, or a long builtin) they are squeezed out once they
+// are at least half the list; the list is checked each time it reaches
+// compactLimit, which is doubled from the size left after each check, so
+// that the cost per root stays constant.
+static size_t removedRoots = 0;
+static size_t compactLimit = 4 * MinRoots;
+
+bool RefCounted::s_collectionDue = false;
+
+void RefCounted::addRoot(const RefCounted* object)
+{
+    if (roots.size() >= compactLimit) {
+        // The interpreter isn't reaching collectCyclesIfDue, so at least
+        // drop the removed roots.
+        if (removedRoots >= roots.size() / 2) {
+            roots.erase(std::remove(roots.begin(), roots.end(), nullptr),
+                        roots.end());
+            for (size_t i = 0; i < roots.size(); i++) {
+                roots[i]->m_root = i + 1;
+            }
+            removedRoots = 0;
+        }
+        compactLimit = std::max(4 * rootLimit, 2 * roots.size());
+    }
+    roots.push_back(object);
+    object->m_root = roots.size();
+    if (roots.size() >= rootLimit) {
+        s_collectionDue = true;
+    }
+}
+
+void RefCounted::removeRoot(const RefCounted* object)
+{
+    roots[object->m_root - 1] = NULL;
+    object->m_root = 0;
+    removedRoots++;
+}
+
+namespace {
+
+template<class F>
+class ChildVisitor : public RefCounted::Visitor {
+public:
+    ChildVisitor(F& f) : m_f(f) { }
+    virtual void visit(const RefCounted* child) { m_f(child); }
+
+private:
+    F& m_f;
+};
+
+}
+
+class CycleCollector {
+public:
+    CycleCollector() : m_traced(0) { }
+
+    int collect();
+
+private:
+    // Calls f for each traced child. Untraced objects can't be part of a
+    // cycle, so they are left alone throughout.
+    template<class F>
+    static void forEachChild(const RefCounted* object, F f) {
+        auto traced = [&f](const RefCounted* child) {
+            if (child->m_traced) {
+                f(child);
+            }
+        };
+        ChildVisitor<decltype(traced)> visitor(traced);
+        object->visitChildren(visitor);
+    }
+
+    void markGrey(const RefCounted* root);
+    void scan(const RefCounted* root);
+    void scanBlack(const RefCounted* object);
+    void collectWhite(const RefCounted* root);
+
+    // These are all iterative, with explicit stacks: structures may be
+    // far deeper than the C++ stack.
+    std::vector<const RefCounted*> m_stack;
+    std::vector<const RefCounted*> m_blackStack;
+    std::vector<const RefCounted*> m_garbage;
+    size_t m_traced;
+};
+
+// Grey: subtract the references from every object reachable from the root,
+// so that what remains of each count is the references from outside.
+void CycleCollector::markGrey(const RefCounted* root)
+{
+    if (root->m_colour == RefCounted::Grey) {
+        return;
+    }
+    root->m_colour = RefCounted::Grey;
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        m_traced++;
+        forEachChild(object, [this](const RefCounted* child) {
+            child->m_refCount--;
+            if (child->m_colour != RefCounted::Grey) {
+                child->m_colour = RefCounted::Grey;
+                m_stack.push_back(child);
+            }
+        });
+    }
+}
+
+// White: grey objects with no references from outside, unless they turn
+// out to be reachable from one which has.
+void CycleCollector::scan(const RefCounted* root)
+{
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        if (object->m_colour != RefCounted::Grey) {
+            continue;
+        }
+        if (object->m_refCount > 0) {
+            scanBlack(object);
+            continue;
+        }
+        object->m_colour = RefCounted::White;
+        forEachChild(object, [this](const RefCounted* child) {
+            m_stack.push_back(child);
+        });
+    }
+}
+
+// Black: live, so put back the references markGrey took away.
+void CycleCollector::scanBlack(const RefCounted* object)
+{
+    object->m_colour = RefCounted::Black;
+    m_blackStack.push_back(object);
+    while (!m_blackStack.empty()) {
+        const RefCounted* next = m_blackStack.back();
+        m_blackStack.pop_back();
+        forEachChild(next, [this](const RefCounted* child) {
+            child->m_refCount++;
+            if (child->m_colour != RefCounted::Black) {
+                child->m_colour = RefCounted::Black;
+                m_blackStack.push_back(child);
+            }
+        });
+    }
+}
+
+void CycleCollector::collectWhite(const RefCounted* root)
+{
+    if (root->m_colour != RefCounted::White) {
+        return;
+    }
+    root->m_colour = RefCounted::Black;
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        m_garbage.push_back(object);
+        forEachChild(object, [this](const RefCounted* child) {
+            if (child->m_colour == RefCounted::White) {
+                child->m_colour = RefCounted::Black;
+                m_stack.push_back(child);
+            }
+        });
+    }
+}
+
+int CycleCollector::collect()
+{
+    RefCounted::s_collectionDue = false;
+
+    // Roots noted while the garbage is freed go in a fresh list.
+    std::vector<const RefCounted*> candidates;
+    candidates.swap(roots);
+    removedRoots = 0;
+    candidates.erase(std::remove(candidates.begin(), candidates.end(), nullptr),
+                     candidates.end());
+    for (auto root : candidates) {
+        root->m_root = 0;
+    }
+
+    for (auto root : candidates) {
+        markGrey(root);
+    }
+    for (auto root : candidates) {
+        scan(root);
+    }
+    for (auto root : candidates) {
+        collectWhite(root);
+    }
+    rootLimit = std::max(MinRoots, m_traced);
+    compactLimit = 4 * rootLimit;
+
+    // The garbage's counts are still missing the references between its
+    // own objects. Put them back and hold on to every object while the
+    // cycles are broken, so that reference counting can then free it all
+    // in the usual way.
+    for (auto object : m_garbage) {
+        forEachChild(object, [](const RefCounted* child) {
+            child->m_refCount++;
+        });
+    }
+    for (auto object : m_garbage) {
+        object->acquire();
+    }
+    for (auto object : m_garbage) {
+        const_cast<RefCounted*>(object)->dropReferences();
+    }
+    for (auto object : m_garbage) {
+        if (object->release() == 0) {
+            RefCounted::destroy(object);
+        }
+        else {
+            object->released();
+        }
+    }
+    return m_garbage.size();
+}
+
+int RefCounted::collectCycles()
+{
+    return CycleCollector().collect();
+}
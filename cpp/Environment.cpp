@@ -2,22 +2,40 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <utility>
+
+static const malSymbol* internedSymbol(const String& name)
+{
+    return STATIC_CAST(malSymbol, mal::symbol(name));
+}
+
+LiveCount malEnv::s_count;
 
 malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+: RefCounted(true)
+, m_bindings(m_inline)
+, m_count(0)
+, m_capacity(InlineBindings)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(malEnvPtr outer, const malSymbolVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: RefCounted(true)
+, m_bindings(m_inline)
+, m_count(0)
+, m_capacity(InlineBindings)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    static const malSymbol* ampersand = internedSymbol("&");
+
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (bindings[i] == ampersand) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
             set(bindings[n-1], mal::list(it, argsEnd));
@@ -33,33 +51,109 @@ malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (m_bindings != m_inline) {
+        delete [] m_bindings;
+    }
 }
 
-malEnvPtr malEnv::find(const String& symbol)
+void malEnv::visitChildren(Visitor& visitor) const
+{
+    for (auto& it : m_map) {
+        visitor.visit(it.second);
+    }
+    for (int i = 0; i < m_count; i++) {
+        visitor.visit(m_bindings[i].value);
+    }
+    visitor.visit(m_outer);
+}
+
+void malEnv::dropReferences()
+{
+    m_map.clear();
+    for (int i = 0; i < m_count; i++) {
+        m_bindings[i].value = malValuePtr();
+    }
+    m_outer = NULL;
+}
+
+malValuePtr* malEnv::lookup(const malSymbol* symbol)
 {
+    if (!m_outer) {
+        auto it = m_map.find(symbol);
+        return it == m_map.end() ? NULL : &it->second;
+    }
+    for (int i = 0; i < m_count; i++) {
+        if (m_bindings[i].symbol == symbol) {
+            return &m_bindings[i].value;
+        }
+    }
+    return NULL;
+}
+
+void malEnv::grow()
+{
+    Binding* bindings = new Binding[m_capacity * 2];
+    std::copy(m_bindings, m_bindings + m_count, bindings);
+    if (m_bindings != m_inline) {
+        delete [] m_bindings;
+    }
+    m_bindings = bindings;
+    m_capacity *= 2;
+}
+
+malEnvPtr malEnv::find(const malSymbol* symbol)
+{
+    symbol = symbol->interned();
     for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+        if (env->lookup(symbol)) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    return find(internedSymbol(symbol));
+}
+
+malValuePtr malEnv::get(const malSymbol* symbol)
+{
+    symbol = symbol->interned();
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (malValuePtr* value = env->lookup(symbol)) {
+            return *value;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    MAL_FAIL("'%s' not found", symbol->value().c_str());
+}
+
+malValuePtr malEnv::get(const String& symbol)
+{
+    return get(internedSymbol(symbol));
+}
+
+malValuePtr malEnv::set(const malSymbol* symbol, malValuePtr value)
+{
+    symbol = symbol->interned();
+    if (malValuePtr* existing = lookup(symbol)) {
+        return *existing = std::move(value);
+    }
+    if (!m_outer) {
+        return m_map[symbol] = std::move(value);
+    }
+    if (m_count == m_capacity) {
+        grow();
+    }
+    Binding& binding = m_bindings[m_count++];
+    binding.symbol = symbol;
+    binding.value  = std::move(value);
+    return binding.value;
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
-    return value;
+    return set(internedSymbol(symbol), value);
 }
 
 malEnvPtr malEnv::getRoot()
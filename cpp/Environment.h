@@ -3,27 +3,99 @@
 
 #include "MAL.h"
 
-#include <map>
+#include <unordered_map>
 
 class malEnv : public RefCounted {
 public:
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+           const malSymbolVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
+    malValuePtr get(const malSymbol* symbol);
+    malEnvPtr   find(const malSymbol* symbol);
+    malValuePtr set(const malSymbol* symbol, malValuePtr value);
+    malEnvPtr   getRoot();
+
+    // These look up the interned symbol for the name first.
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
-    malEnvPtr   getRoot();
+
+    // Fetch a local which the analyser has resolved to a frame depth and
+    // slot. Slots are numbered in the order names were first bound.
+    const malValuePtr& get(int depth, int slot) const {
+        const malEnv* env = this;
+        while (depth-- > 0) {
+            env = env->m_outer.ptr();
+        }
+        return env->m_bindings[slot].value;
+    }
+
+    malEnv* frame(int depth) {
+        malEnv* env = this;
+        while (depth-- > 0) {
+            env = env->m_outer.ptr();
+        }
+        return env;
+    }
+    const malEnvPtr& outer() const { return m_outer; }
+
+    // Where the global environment keeps a symbol's value, or NULL if this
+    // isn't the global environment or the symbol isn't bound. Bindings stay
+    // where they are, and def! updates them in place. The symbol must be
+    // the interned one.
+    malValuePtr* globalValue(const malSymbol* symbol) {
+        return m_outer ? NULL : lookup(symbol);
+    }
+
+    virtual void visitChildren(Visitor& visitor) const;
+    virtual void dropReferences();
+
+    // Counted as they are allocated, so that an environment whose
+    // constructor throws is uncounted again.
+    static void* operator new(size_t size) {
+        s_count.created();
+        return Pool::allocate(size);
+    }
+    static void operator delete(void* p, size_t size) {
+        s_count.destroyed();
+        Pool::deallocate(p, size);
+    }
+
+    // The environments alive now, and the most there have been at once.
+    static const LiveCount& liveCount() { return s_count; }
 
 private:
-    typedef std::map<String, malValuePtr> Map;
-    Map m_map;
+    malEnv(const malEnv&);
+    malEnv& operator=(const malEnv&);
+
+    malValuePtr* lookup(const malSymbol* symbol);
+    void grow();
+
+    // Symbols are interned, so bindings are keyed by the symbol's address.
+    // The global environment is a hash table. Every other frame belongs to
+    // a function call, let* or catch*, so it is small: it keeps its bindings
+    // in an array in the order they were bound, and searches it linearly.
+    // The first few live inside the malEnv itself.
+    struct Binding {
+        const malSymbol* symbol;
+        malValuePtr      value;
+    };
+    typedef std::unordered_map<const malSymbol*, malValuePtr> Map;
+    static const int InlineBindings = 4;
+
+    Map       m_map;
+    Binding   m_inline[InlineBindings];
+    Binding*  m_bindings;
+    int       m_count;
+    int       m_capacity;
     malEnvPtr m_outer;
+
+    static LiveCount s_count;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -5,28 +5,50 @@
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
+#include "ValuePtr.h"
 
 #include <vector>
 
-class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
-typedef std::vector<malValuePtr> malValueVec;
+
+// Both the vector and its items come from the pool.
+class malValueVec
+: public std::vector<malValuePtr, PoolAllocator<malValuePtr> > {
+public:
+    typedef std::vector<malValuePtr, PoolAllocator<malValuePtr> > Base;
+    using Base::Base;
+
+    POOL_ALLOCATED
+};
 typedef malValueVec::iterator    malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+// Borrowed references, for parameters which are only looked at. Passing
+// these costs no refcount traffic; take a copy to keep hold of the value.
+typedef const malValuePtr& malValueRef;
+typedef const malEnvPtr&   malEnvRef;
+
+class malSymbol;
+typedef std::vector<const malSymbol*> malSymbolVec;
+
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(malValueRef op,
                          malValueIter argsBegin, malValueIter argsEnd,
-                         malEnvPtr env);
-extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
+                         malEnvRef env);
+extern malValuePtr EVAL(malValueRef ast, malEnvRef env);
 extern malValuePtr readline(const String& prompt);
 extern String rep(const String& input, malEnvPtr env);
 
 // Core.cpp
 extern void installCore(malEnvPtr env);
 
+#ifdef MAL_ALLOC_STATS
+// Memory.cpp
+extern unsigned long allocationCount();
+#endif
+
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
 
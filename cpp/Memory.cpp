@@ -0,0 +1,142 @@
+#include "MAL.h"
+#include "Memory.h"
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef MAL_ALLOC_STATS
+// Every heap allocation is counted, so that benchmarks can report how many
+// allocations their code makes. Blocks from the pool count as allocations
+// too, although most of them cost far less. Build with make ALLOC_STATS=1.
+static unsigned long allocations = 0;
+
+unsigned long allocationCount()
+{
+    return allocations + Pool::allocationCount();
+}
+#endif
+
+const size_t Pool::SlabSize;
+const size_t Pool::ChunkSize;
+
+Pool::SizeClass Pool::s_classes[Pool::Classes];
+Pool::Slab*     Pool::s_spare    = NULL;
+char*           Pool::s_chunk    = NULL;
+char*           Pool::s_chunkEnd = NULL;
+
+Pool::Slab* Pool::refill(SizeClass& sc, size_t size)
+{
+    Slab* slab = s_spare;
+    if (slab != NULL) {
+        s_spare = slab->next;
+    }
+    else {
+        if (s_chunk == s_chunkEnd) {
+            void* chunk;
+            if (posix_memalign(&chunk, SlabSize, ChunkSize) != 0) {
+                throw std::bad_alloc();
+            }
+            s_chunk    = static_cast<char*>(chunk);
+            s_chunkEnd = s_chunk + ChunkSize;
+        }
+        slab = reinterpret_cast<Slab*>(s_chunk);
+        s_chunk += SlabSize;
+    }
+    sc.slabs++;
+    sc.empty++;
+
+    // Thread the blocks in address order, so that they're handed out so.
+    size = (classOf(size) + 1) * Granule;
+    char* blocks = reinterpret_cast<char*>(slab) + sizeof(Slab);
+    size_t count = (SlabSize - sizeof(Slab)) / size;
+    for (size_t i = 0; i + 1 < count; i++) {
+        *reinterpret_cast<void**>(blocks + i * size) = blocks + (i + 1) * size;
+    }
+    *reinterpret_cast<void**>(blocks + (count - 1) * size) = NULL;
+    slab->free = blocks;
+    slab->live = 0;
+    link(sc, slab);
+    return slab;
+}
+
+void Pool::release(SizeClass& sc, Slab* slab)
+{
+    unlink(sc, slab);
+    slab->next = s_spare;
+    s_spare = slab;
+    sc.empty--;
+    sc.slabs--;
+    sc.released++;
+}
+
+int Pool::stats(Stats* stats)
+{
+    int used = 0;
+    for (int i = 0; i < Classes; i++) {
+        const SizeClass& sc = s_classes[i];
+        if (sc.allocated != 0) {
+            Stats& s    = stats[used++];
+            s.size      = (i + 1) * Granule;
+            s.live      = sc.live;
+            s.peak      = sc.peak;
+            s.allocated = sc.allocated;
+            s.slabs     = sc.slabs;
+            s.released  = sc.released;
+        }
+    }
+    return used;
+}
+
+unsigned long Pool::allocationCount()
+{
+    unsigned long total = 0;
+    for (int i = 0; i < Classes; i++) {
+        total += s_classes[i].allocated;
+    }
+    return total;
+}
+
+#ifdef MAL_ALLOC_STATS
+void* operator new(std::size_t size)
+{
+    allocations++;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+#endif
+
+// The most objects one call to RefCounted::destroy will delete. Deleting an
+// object usually takes well under a microsecond.
+static const size_t DestroyBatch = 1024;
+
+void RefCounted::destroy(const RefCounted* object)
+{
+    // Never freed, as objects may be released during static destruction.
+    static std::vector<const RefCounted*>& pending =
+        *new std::vector<const RefCounted*>;
+    static bool destroying = false;
+
+    if (object->m_root) {
+        removeRoot(object);
+    }
+    pending.push_back(object);
+    if (destroying) {
+        return;
+    }
+
+    destroying = true;
+    for (size_t i = 0; (i < DestroyBatch) && !pending.empty(); i++) {
+        const RefCounted* next = pending.back();
+        pending.pop_back();
+        delete next;
+    }
+    destroying = false;
+}
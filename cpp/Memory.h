@@ -0,0 +1,193 @@
+#ifndef INCLUDE_MEMORY_H
+#define INCLUDE_MEMORY_H
+
+#include <cstddef>
+#include <new>
+
+// Free lists of small blocks, one per size class, for values, environments
+// and the item buffers of malValueVecs. Nearly all of these are small and
+// short-lived, so a block is normally taken from and given back to the head
+// of a free list without going near malloc.
+//
+// Each size class carves its blocks from slabs, aligned to their size so
+// that a block's slab is found from its address. A slab keeps its own free
+// list, and the class keeps a list of the slabs which have free blocks.
+// A slab whose blocks have all been freed is given up, to be used by any
+// size class, unless it is the only empty slab its class has. Slabs are
+// never given back to the system.
+//
+// The interpreter is single-threaded, so the lists are shared. Each thread
+// would need lists of its own.
+class Pool {
+public:
+    static const size_t Granule = 8;
+    static const size_t MaxSize = 256;  // bigger blocks come from malloc
+    static const int    Classes = MaxSize / Granule;
+
+    static void* allocate(size_t size) {
+        if (size > MaxSize) {
+            return ::operator new(size);
+        }
+        SizeClass& sc = s_classes[classOf(size)];
+        Slab* slab = sc.partial;
+        if (slab == NULL) {
+            slab = refill(sc, size);
+        }
+        void* p = slab->free;
+        slab->free = *static_cast<void**>(p);
+        if (slab->live++ == 0) {
+            sc.empty--;
+        }
+        if (slab->free == NULL) {
+            unlink(sc, slab);
+        }
+        sc.allocated++;
+        if (++sc.live > sc.peak) {
+            sc.peak = sc.live;
+        }
+        return p;
+    }
+
+    static void deallocate(void* p, size_t size) {
+        if (size > MaxSize) {
+            ::operator delete(p);
+            return;
+        }
+        SizeClass& sc = s_classes[classOf(size)];
+        Slab* slab = slabOf(p);
+        if (slab->free == NULL) {
+            link(sc, slab);
+        }
+        *static_cast<void**>(p) = slab->free;
+        slab->free = p;
+        sc.live--;
+        if ((--slab->live == 0) && (sc.empty++ != 0)) {
+            release(sc, slab);
+        }
+    }
+
+    struct Stats {
+        size_t        size;       // of the blocks in this class
+        long          live;       // blocks in use now
+        long          peak;       // the most ever in use at once
+        unsigned long allocated;  // blocks handed out so far
+        size_t        slabs;      // held now
+        size_t        released;   // given up so far
+    };
+
+    // The classes which have been used, smallest first.
+    static int stats(Stats* stats);
+
+    // Blocks handed out over all the classes.
+    static unsigned long allocationCount();
+
+private:
+    static const size_t SlabSize  = 16 * 1024;
+    static const size_t ChunkSize = 64 * SlabSize;  // got from malloc
+
+    struct Slab {
+        Slab* prev;  // in its class's list of slabs with free blocks
+        Slab* next;
+        void* free;
+        long  live;
+    };
+
+    struct SizeClass {
+        Slab*         partial;  // slabs with free blocks
+        long          empty;    // slabs with no blocks in use
+        long          live;
+        long          peak;
+        unsigned long allocated;
+        size_t        slabs;
+        size_t        released;
+    };
+
+    static size_t classOf(size_t size) {
+        return size ? (size - 1) / Granule : 0;
+    }
+
+    static Slab* slabOf(void* p) {
+        return reinterpret_cast<Slab*>(
+            reinterpret_cast<size_t>(p) & ~(SlabSize - 1));
+    }
+
+    static void link(SizeClass& sc, Slab* slab) {
+        slab->prev = NULL;
+        slab->next = sc.partial;
+        if (sc.partial != NULL) {
+            sc.partial->prev = slab;
+        }
+        sc.partial = slab;
+    }
+
+    static void unlink(SizeClass& sc, Slab* slab) {
+        if (slab->prev != NULL) {
+            slab->prev->next = slab->next;
+        }
+        else {
+            sc.partial = slab->next;
+        }
+        if (slab->next != NULL) {
+            slab->next->prev = slab->prev;
+        }
+    }
+
+    static Slab* refill(SizeClass& sc, size_t size);
+    static void release(SizeClass& sc, Slab* slab);
+
+    static SizeClass s_classes[Classes];
+    static Slab*     s_spare;      // given up by their classes
+    static char*     s_chunk;      // the rest of the chunk being carved
+    static char*     s_chunkEnd;
+};
+
+// Counts the objects of one kind which are alive, and the most there have
+// been at once.
+struct LiveCount {
+    long live;
+    long peak;
+
+    void created() {
+        if (++live > peak) {
+            peak = live;
+        }
+    }
+    void destroyed() { live--; }
+};
+
+// For std containers.
+template<class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    PoolAllocator() { }
+    template<class U> PoolAllocator(const PoolAllocator<U>&) { }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(Pool::allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, size_t n) {
+        Pool::deallocate(p, n * sizeof(T));
+    }
+
+    template<class U>
+    bool operator == (const PoolAllocator<U>&) const { return true; }
+    template<class U>
+    bool operator != (const PoolAllocator<U>&) const { return false; }
+};
+
+// Gives a class and its subclasses pooled operator new and delete. The
+// sized delete gets the size of the object's own class as long as the
+// destructor is virtual.
+#define POOL_ALLOCATED \
+    static void* operator new(size_t size) { \
+        return Pool::allocate(size); \
+    } \
+    static void operator delete(void* p, size_t size) { \
+        Pool::deallocate(p, size); \
+    } \
+    static void* operator new(size_t, void* p) { return p; } \
+    static void operator delete(void*, void*) { }
+
+#endif // INCLUDE_MEMORY_H
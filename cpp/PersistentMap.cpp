@@ -0,0 +1,343 @@
+#include "PersistentMap.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <new>
+
+static const int Bits = 5;
+static const int Mask = (1 << Bits) - 1;
+static const int HashBits = 32;
+
+static int popCount(uint32_t bits)
+{
+    return __builtin_popcount(bits);
+}
+
+static uint32_t bitFor(uint32_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & Mask);
+}
+
+static int indexFor(uint32_t bitmap, uint32_t bit)
+{
+    return popCount(bitmap & (bit - 1));
+}
+
+PersistentMap::Node* PersistentMap::Node::create(uint32_t bitmap, int count)
+{
+    void* memory = ::operator new(sizeof(Node) + count * sizeof(Entry));
+    Node* node = new (memory) Node(bitmap, count);
+    Entry* entries = node->entries();
+    for (int i = 0; i < count; i++) {
+        new (entries + i) Entry();
+    }
+    return node;
+}
+
+PersistentMap::Node* PersistentMap::Node::copy(const Node* node, int count)
+{
+    Node* copy = create(node->bitmap, count);
+    std::copy(node->entries(), node->entries() + std::min(count, node->count),
+              copy->entries());
+    return copy;
+}
+
+PersistentMap::Node::~Node()
+{
+    Entry* entries = this->entries();
+    for (int i = 0; i < count; i++) {
+        entries[i].~Entry();
+    }
+}
+
+void PersistentMap::Node::operator delete(void* p)
+{
+    ::operator delete(p);
+}
+
+void PersistentMap::Node::visitChildren(Visitor& visitor) const
+{
+    const Entry* entries = this->entries();
+    for (int i = 0; i < count; i++) {
+        visitor.visit(entries[i].key);
+        visitor.visit(entries[i].value);
+        visitor.visit(entries[i].child);
+    }
+}
+
+uint32_t PersistentMap::hashOf(malValueRef key)
+{
+    return static_cast<const malStringBase*>(key.ptr())->hash();
+}
+
+bool PersistentMap::keysEqual(malValueRef lhs, malValueRef rhs)
+{
+    if (lhs == rhs) {
+        return true;
+    }
+    return (lhs->tag() == rhs->tag()) &&
+           (static_cast<const malStringBase*>(lhs.ptr())->value() ==
+            static_cast<const malStringBase*>(rhs.ptr())->value());
+}
+
+const malValuePtr* PersistentMap::find(malValueRef key) const
+{
+    uint32_t hash = hashOf(key);
+    const Node* node = m_root.ptr();
+    for (int shift = 0; node != NULL; shift += Bits) {
+        const Entry* entries = node->entries();
+        if (node->isCollision()) {
+            for (int i = 0; i < node->count; i++) {
+                if (keysEqual(entries[i].key, key)) {
+                    return &entries[i].value;
+                }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = bitFor(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return NULL;
+        }
+        const Entry& entry = entries[indexFor(node->bitmap, bit)];
+        if (!entry.child) {
+            if ((entry.hash == hash) && keysEqual(entry.key, key)) {
+                return &entry.value;
+            }
+            return NULL;
+        }
+        node = entry.child.ptr();
+    }
+    return NULL;
+}
+
+PersistentMap PersistentMap::assoc(malValueRef key, malValueRef value) const
+{
+    Entry entry;
+    entry.hash  = hashOf(key);
+    entry.key   = key;
+    entry.value = value;
+
+    bool added = false;
+    PersistentMap result;
+    result.m_root  = assoc(m_root.ptr(), 0, entry, added);
+    result.m_count = m_count + (added ? 1 : 0);
+    return result;
+}
+
+void PersistentMap::assocInPlace(malValueRef key, malValueRef value)
+{
+    Entry entry;
+    entry.hash  = hashOf(key);
+    entry.key   = key;
+    entry.value = value;
+
+    bool added = false;
+    m_root = assocInPlace(m_root.ptr(), 0, entry, added);
+    m_count += added ? 1 : 0;
+}
+
+PersistentMap PersistentMap::dissoc(malValueRef key) const
+{
+    if (!m_root) {
+        return *this;
+    }
+
+    bool removed = false;
+    PersistentMap result;
+    result.m_root  = dissoc(m_root.ptr(), 0, hashOf(key), key, removed);
+    result.m_count = m_count - (removed ? 1 : 0);
+    return result;
+}
+
+PersistentMap::NodePtr
+PersistentMap::assoc(const Node* node, int shift, const Entry& entry,
+                     bool& added)
+{
+    if (node == NULL) {
+        Node* leaf = Node::create(bitFor(entry.hash, shift), 1);
+        leaf->entries()[0] = entry;
+        added = true;
+        return leaf;
+    }
+
+    const Entry* entries = node->entries();
+    if (node->isCollision()) {
+        for (int i = 0; i < node->count; i++) {
+            if (keysEqual(entries[i].key, entry.key)) {
+                Node* copy = Node::copy(node, node->count);
+                copy->entries()[i] = entry;
+                return copy;
+            }
+        }
+        Node* copy = Node::copy(node, node->count + 1);
+        copy->entries()[node->count] = entry;
+        added = true;
+        return copy;
+    }
+
+    uint32_t bit = bitFor(entry.hash, shift);
+    int index = indexFor(node->bitmap, bit);
+
+    if ((node->bitmap & bit) == 0) {
+        // A new slot: copy the entries either side of it.
+        Node* copy = Node::create(node->bitmap | bit, node->count + 1);
+        Entry* copyEntries = copy->entries();
+        std::copy(entries, entries + index, copyEntries);
+        copyEntries[index] = entry;
+        std::copy(entries + index, entries + node->count,
+                  copyEntries + index + 1);
+        added = true;
+        return copy;
+    }
+
+    const Entry& existing = entries[index];
+    Node* copy = Node::copy(node, node->count);
+    Entry& slot = copy->entries()[index];
+    if (existing.child) {
+        slot.child = assoc(existing.child.ptr(), shift + Bits, entry, added);
+    }
+    else if ((existing.hash == entry.hash) &&
+             keysEqual(existing.key, entry.key)) {
+        slot.value = entry.value;
+    }
+    else {
+        slot.child = merge(existing, entry, shift + Bits);
+        slot.key   = malValuePtr();
+        slot.value = malValuePtr();
+        added = true;
+    }
+    return copy;
+}
+
+// A node held only by its parent, or as the root by this map, can't be
+// seen by any other map. Its entries change in place, but it must still be
+// replaced to gain a slot, as its entries are allocated with it.
+PersistentMap::NodePtr
+PersistentMap::assocInPlace(Node* node, int shift, const Entry& entry,
+                            bool& added)
+{
+    if ((node == NULL) || (node->refCount() != 1)) {
+        return assoc(node, shift, entry, added);
+    }
+
+    Entry* entries = node->entries();
+    if (node->isCollision()) {
+        for (int i = 0; i < node->count; i++) {
+            if (keysEqual(entries[i].key, entry.key)) {
+                entries[i] = entry;
+                return node;
+            }
+        }
+        return assoc(node, shift, entry, added);
+    }
+
+    uint32_t bit = bitFor(entry.hash, shift);
+    if ((node->bitmap & bit) == 0) {
+        return assoc(node, shift, entry, added);
+    }
+
+    Entry& slot = entries[indexFor(node->bitmap, bit)];
+    if (slot.child) {
+        slot.child = assocInPlace(slot.child.ptr(), shift + Bits, entry, added);
+    }
+    else if ((slot.hash == entry.hash) && keysEqual(slot.key, entry.key)) {
+        slot.value = entry.value;
+    }
+    else {
+        slot.child = merge(slot, entry, shift + Bits);
+        slot.key   = malValuePtr();
+        slot.value = malValuePtr();
+        added = true;
+    }
+    return node;
+}
+
+PersistentMap::NodePtr
+PersistentMap::merge(const Entry& lhs, const Entry& rhs, int shift)
+{
+    if (shift >= HashBits) {
+        Node* collision = Node::create(0, 2);
+        collision->entries()[0] = lhs;
+        collision->entries()[1] = rhs;
+        return collision;
+    }
+
+    uint32_t lhsBit = bitFor(lhs.hash, shift);
+    uint32_t rhsBit = bitFor(rhs.hash, shift);
+    if (lhsBit == rhsBit) {
+        Node* node = Node::create(lhsBit, 1);
+        node->entries()[0].child = merge(lhs, rhs, shift + Bits);
+        return node;
+    }
+
+    Node* node = Node::create(lhsBit | rhsBit, 2);
+    bool lhsFirst = lhsBit < rhsBit;
+    node->entries()[0] = lhsFirst ? lhs : rhs;
+    node->entries()[1] = lhsFirst ? rhs : lhs;
+    return node;
+}
+
+PersistentMap::NodePtr
+PersistentMap::dissoc(const Node* node, int shift, uint32_t hash,
+                      malValueRef key, bool& removed)
+{
+    const Entry* entries = node->entries();
+    int index = -1;
+    uint32_t bit = 0;
+
+    if (node->isCollision()) {
+        for (int i = 0; i < node->count; i++) {
+            if (keysEqual(entries[i].key, key)) {
+                index = i;
+            }
+        }
+    }
+    else {
+        bit = bitFor(hash, shift);
+        if ((node->bitmap & bit) == 0) {
+            return const_cast<Node*>(node);
+        }
+        index = indexFor(node->bitmap, bit);
+
+        const Entry& existing = entries[index];
+        if (existing.child) {
+            NodePtr child = dissoc(existing.child.ptr(), shift + Bits,
+                                   hash, key, removed);
+            if (child == existing.child) {
+                return const_cast<Node*>(node);
+            }
+            if (child) {
+                Node* copy = Node::copy(node, node->count);
+                Entry& slot = copy->entries()[index];
+                // A child left with a single key/value is pulled up into
+                // this node, so that maps which have shrunk stay compact.
+                if ((child->count == 1) && !child->entries()[0].child) {
+                    slot = child->entries()[0];
+                }
+                else {
+                    slot.child = child;
+                }
+                return copy;
+            }
+            // The child is empty: drop its slot, as for a key below.
+        }
+        else if ((existing.hash != hash) || !keysEqual(existing.key, key)) {
+            return const_cast<Node*>(node);
+        }
+    }
+
+    if (index < 0) {
+        return const_cast<Node*>(node);
+    }
+
+    removed = true;
+    if (node->count == 1) {
+        return NodePtr();
+    }
+    Node* copy = Node::create(node->bitmap & ~bit, node->count - 1);
+    Entry* copyEntries = copy->entries();
+    std::copy(entries, entries + index, copyEntries);
+    std::copy(entries + index + 1, entries + node->count, copyEntries + index);
+    return copy;
+}
@@ -0,0 +1,114 @@
+#ifndef INCLUDE_PERSISTENTMAP_H
+#define INCLUDE_PERSISTENTMAP_H
+
+#include "MAL.h"
+
+#include <cstdint>
+
+// An immutable hash map which shares structure with the maps it was made
+// from: a hash array mapped trie. Each node uses 5 bits of the key's hash
+// to pick one of 32 slots, and only stores the slots which are in use,
+// with a bitmap saying which those are. assoc and dissoc copy only the
+// nodes on the path to the key. Keys whose hashes are identical end up
+// together in a collision node, which is searched linearly.
+//
+// Keys must be strings or keywords: malHash checks that. Finding a key
+// neither prints nor allocates.
+class PersistentMap {
+public:
+    PersistentMap() : m_count(0) { }
+
+    int count() const { return m_count; }
+
+    // Returns NULL if the key isn't there.
+    const malValuePtr* find(malValueRef key) const;
+
+    PersistentMap assoc(malValueRef key, malValueRef value) const;
+    PersistentMap dissoc(malValueRef key) const;
+
+    // As assoc, but changes this map. Nodes which no other map shares are
+    // updated in place, so that a map built up a key at a time only copies
+    // the node which gains a slot, and not its path from the root.
+    void assocInPlace(malValueRef key, malValueRef value);
+
+    // For the cycle collector: visits the root node.
+    void visitNodes(RefCounted::Visitor& visitor) const {
+        visitor.visit(m_root);
+    }
+
+    // Calls f(key, value) for each entry, in an arbitrary but fixed order.
+    template <typename F>
+    void forEach(F f) const {
+        if (m_root) {
+            forEach(m_root.ptr(), f);
+        }
+    }
+
+private:
+    class Node;
+    typedef RefCountedPtr<Node> NodePtr;
+
+    struct Entry {
+        uint32_t    hash;
+        malValuePtr key;
+        malValuePtr value;  // unset if this slot holds a child node
+        NodePtr     child;
+    };
+
+    // Nodes are allocated with their entries following them, so that a
+    // node costs one allocation.
+    class Node : public RefCounted {
+    public:
+        static Node* create(uint32_t bitmap, int count);
+        static Node* copy(const Node* node, int count);
+        ~Node();
+
+        static void operator delete(void* p);
+
+        virtual void visitChildren(Visitor& visitor) const;
+
+        Entry* entries() { return reinterpret_cast<Entry*>(this + 1); }
+        const Entry* entries() const {
+            return reinterpret_cast<const Entry*>(this + 1);
+        }
+
+        // A collision node has no bitmap.
+        bool isCollision() const { return bitmap == 0; }
+
+        const uint32_t bitmap;
+        const int      count;
+
+    private:
+        Node(uint32_t bitmap, int count)
+        : RefCounted(true), bitmap(bitmap), count(count) { }
+    };
+
+    static uint32_t hashOf(malValueRef key);
+    static bool keysEqual(malValueRef lhs, malValueRef rhs);
+
+    static NodePtr assoc(const Node* node, int shift, const Entry& entry,
+                         bool& added);
+    static NodePtr assocInPlace(Node* node, int shift, const Entry& entry,
+                                bool& added);
+    static NodePtr dissoc(const Node* node, int shift, uint32_t hash,
+                          malValueRef key, bool& removed);
+    static NodePtr merge(const Entry& lhs, const Entry& rhs, int shift);
+
+    template <typename F>
+    static void forEach(const Node* node, F& f) {
+        const Entry* entries = node->entries();
+        for (int i = 0; i < node->count; i++) {
+            if (entries[i].child) {
+                forEach(entries[i].child.ptr(), f);
+            }
+            else {
+                f(entries[i].key, entries[i].value);
+            }
+        }
+    }
+
+    int     m_count;
+    NodePtr m_root;
+};
+
+#endif // INCLUDE_PERSISTENTMAP_H
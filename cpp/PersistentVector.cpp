@@ -0,0 +1,185 @@
+#include "PersistentVector.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <vector>
+
+const int PersistentVector::Width;
+
+// The leaves are filled directly and the trie built up from them a level
+// at a time, rather than appending the items one by one.
+PersistentVector::PersistentVector(malValueIter begin, malValueIter end)
+: m_count(std::distance(begin, end))
+, m_shift(Bits)
+{
+    if (m_count == 0) {
+        return;
+    }
+
+    int tailStart = tailOffset();
+    std::vector<NodePtr> nodes;
+    for (int i = 0; i < tailStart; i += Width) {
+        nodes.push_back(newLeaf(begin + i, Width));
+    }
+    while (nodes.size() > Width) {
+        std::vector<NodePtr> parents;
+        for (size_t i = 0; i < nodes.size(); i += Width) {
+            parents.push_back(newBranch(nodes, i));
+        }
+        nodes.swap(parents);
+        m_shift += Bits;
+    }
+    if (!nodes.empty()) {
+        m_root = newBranch(nodes, 0);
+    }
+    m_tail = newLeaf(begin + tailStart, m_count - tailStart);
+}
+
+void PersistentVector::Leaf::visitChildren(Visitor& visitor) const
+{
+    for (auto& value : values) {
+        visitor.visit(value);
+    }
+}
+
+void PersistentVector::Leaf::set(int index, malValueRef value)
+{
+    values[index] = value;
+    const malValue* object = value.ptr();
+    traceIf(object && object->isTraced());
+}
+
+void PersistentVector::Branch::visitChildren(Visitor& visitor) const
+{
+    for (auto& child : children) {
+        visitor.visit(child);
+    }
+}
+
+const PersistentVector::Leaf* PersistentVector::leafFor(int index) const
+{
+    if (index >= tailOffset()) {
+        return m_tail.ptr();
+    }
+    const Node* node = m_root.ptr();
+    for (int level = m_shift; level > 0; level -= Bits) {
+        const Branch* branch = static_cast<const Branch*>(node);
+        node = branch->children[(index >> level) & Mask].ptr();
+    }
+    return static_cast<const Leaf*>(node);
+}
+
+malValueRef PersistentVector::item(int index) const
+{
+    return leafFor(index)->values[index & Mask];
+}
+
+PersistentVector PersistentVector::conj(malValueRef value) const
+{
+    PersistentVector result(*this);
+    result.m_count++;
+
+    int tailCount = m_count - tailOffset();
+    if (tailCount < Width) {
+        if (!m_tail || (m_tail->used != tailCount)) {
+            Leaf* tail = new Leaf;
+            if (m_tail) {
+                std::copy(m_tail->values, m_tail->values + tailCount,
+                          tail->values);
+                tail->traceIf(m_tail->isTraced());
+            }
+            result.m_tail = tail;
+        }
+        result.m_tail->set(tailCount, value);
+        result.m_tail->used = tailCount + 1;
+        return result;
+    }
+
+    // The tail is full, so it goes into the trie, which grows a level when
+    // the root is full too.
+    NodePtr tail(m_tail.ptr());
+    if ((m_count >> Bits) > (1 << m_shift)) {
+        Branch* root = new Branch;
+        root->set(0, m_root);
+        root->set(1, newPath(m_shift, tail));
+        result.m_root = root;
+        result.m_shift += Bits;
+    }
+    else {
+        result.m_root = pushTail(m_shift, m_root.ptr(), tail);
+    }
+
+    Leaf* newTail = new Leaf;
+    newTail->set(0, value);
+    newTail->used = 1;
+    result.m_tail = newTail;
+    return result;
+}
+
+PersistentVector::NodePtr
+PersistentVector::pushTail(int level, const Node* parent,
+                           const NodePtr& tail) const
+{
+    int index = ((m_count - 1) >> level) & Mask;
+    const Branch* parentBranch = static_cast<const Branch*>(parent);
+    Branch* branch = new Branch;
+    if (parentBranch) {
+        std::copy(parentBranch->children, parentBranch->children + Width,
+                  branch->children);
+        branch->traceIf(parentBranch->isTraced());
+    }
+
+    if (level == Bits) {
+        branch->set(index, tail);
+    }
+    else if (parentBranch && parentBranch->children[index]) {
+        branch->set(index,
+            pushTail(level - Bits, parentBranch->children[index].ptr(), tail));
+    }
+    else {
+        branch->set(index, newPath(level - Bits, tail));
+    }
+    return branch;
+}
+
+PersistentVector::Leaf*
+PersistentVector::newLeaf(malValueIter items, int count)
+{
+    Leaf* leaf = new Leaf;
+    for (int i = 0; i < count; i++) {
+        leaf->set(i, items[i]);
+    }
+    leaf->used = count;
+    return leaf;
+}
+
+PersistentVector::Branch*
+PersistentVector::newBranch(const std::vector<NodePtr>& nodes, size_t first)
+{
+    Branch* branch = new Branch;
+    size_t count = std::min(nodes.size() - first, size_t(Width));
+    for (size_t i = 0; i < count; i++) {
+        branch->set(i, nodes[first + i]);
+    }
+    return branch;
+}
+
+PersistentVector::NodePtr
+PersistentVector::newPath(int level, const NodePtr& node)
+{
+    if (level == 0) {
+        return node;
+    }
+    Branch* branch = new Branch;
+    branch->set(0, newPath(level - Bits, node));
+    return branch;
+}
+
+void PersistentVector::copyTo(malValueIter dest) const
+{
+    for (int i = 0; i < m_count; i += Width) {
+        const Leaf* leaf = leafFor(i);
+        int n = std::min(Width, m_count - i);
+        dest = std::copy(leaf->values, leaf->values + n, dest);
+    }
+}
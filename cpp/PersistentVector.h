@@ -0,0 +1,93 @@
+#ifndef INCLUDE_PERSISTENTVECTOR_H
+#define INCLUDE_PERSISTENTVECTOR_H
+
+#include "MAL.h"
+
+#include <vector>
+
+// An immutable vector which shares structure with the vectors it was made
+// from: a 32-way trie of the items, plus a tail of the last 32 or fewer,
+// so that an append normally only touches the tail. Indexing walks one
+// node per 5 bits of the index.
+//
+// A tail slot past a vector's own count is never seen by that vector, so
+// the first vector to append to a shared tail writes into it in place.
+// Any other vector sharing the tail copies it.
+class PersistentVector {
+public:
+    PersistentVector() : m_count(0), m_shift(Bits) { }
+    PersistentVector(malValueIter begin, malValueIter end);
+
+    int count() const { return m_count; }
+    malValueRef item(int index) const;
+
+    PersistentVector conj(malValueRef value) const;
+
+    // Copies the items out in order, to dest onwards.
+    void copyTo(malValueIter dest) const;
+
+    // For the cycle collector: visits the trie's root and tail.
+    void visitNodes(RefCounted::Visitor& visitor) const {
+        visitor.visit(m_root);
+        visitor.visit(m_tail);
+    }
+
+    // Whether the trie holds anything the cycle collector traces.
+    bool isTraced() const {
+        return (m_root && m_root->isTraced()) || (m_tail && m_tail->isTraced());
+    }
+
+    static const int Bits  = 5;
+    static const int Width = 1 << Bits;
+    static const int Mask  = Width - 1;
+
+private:
+    // A node is only traced once it holds something which is, so that a
+    // vector of plain data costs the cycle collector nothing.
+    class Node : public RefCounted {
+    public:
+        Node() : RefCounted(false) { }
+        void traceIf(bool traced) const {
+            if (traced) {
+                markTraced();
+            }
+        }
+    };
+    typedef RefCountedPtr<Node> NodePtr;
+
+    class Leaf : public Node {
+    public:
+        Leaf() : used(0) { }
+        virtual void visitChildren(Visitor& visitor) const;
+        void set(int index, malValueRef value);
+        malValuePtr values[Width];
+        int         used;
+    };
+
+    class Branch : public Node {
+    public:
+        virtual void visitChildren(Visitor& visitor) const;
+        void set(int index, const NodePtr& child) {
+            children[index] = child;
+            traceIf(child->isTraced());
+        }
+        NodePtr children[Width];
+    };
+
+    int tailOffset() const {
+        return m_count < Width ? 0 : ((m_count - 1) >> Bits) << Bits;
+    }
+
+    const Leaf* leafFor(int index) const;
+    NodePtr pushTail(int level, const Node* parent, const NodePtr& tail) const;
+    static NodePtr newPath(int level, const NodePtr& node);
+    static Leaf* newLeaf(malValueIter items, int count);
+    static Branch* newBranch(const std::vector<NodePtr>& nodes, size_t first);
+
+    int                  m_count;
+    int                  m_shift;
+    NodePtr              m_root;
+    RefCountedPtr<Leaf>  m_tail;
+};
+
+#endif // INCLUDE_PERSISTENTVECTOR_H
@@ -1,48 +1,97 @@
 #include "MAL.h"
 #include "Types.h"
 
-#include <regex>
+#include <memory>
+
+// The tokeniser is a hand-written scanner driven by a character class
+// table. It produces the same tokens as these regexes, tried in order after
+// skipping whitespace ([\s,]+) and comments (;.*):
+//
+//      ~@
+//      [\[\]{}()'`~^@]
+//      "(?:\\.|[^\\"])*"
+//      [^\s\[\]{}('"`,;)]+
+
+enum CharClass {
+    CC_SYMBOL,      // constituent of a symbol, keyword or number
+    CC_SPACE,       // whitespace and commas
+    CC_COMMENT,     // ; to end of line
+    CC_SPECIAL,     // single-character token
+    CC_STRING,      // opening "
+    CC_TILDE,       // ~ or ~@
+};
 
-typedef std::regex              Regex;
+class CharClassTable {
+public:
+    CharClassTable() {
+        for (int i = 0; i < 256; i++) {
+            m_table[i] = CC_SYMBOL;
+        }
+        for (const char* p = " \t\n\v\f\r,"; *p; p++) {
+            set(*p, CC_SPACE);
+        }
+        for (const char* p = "[]{}()'`^@"; *p; p++) {
+            set(*p, CC_SPECIAL);
+        }
+        set(';', CC_COMMENT);
+        set('"', CC_STRING);
+        set('~', CC_TILDE);
+
+        // Once a symbol has started, only these end it, so it can go on
+        // to contain ~, @ and ^.
+        for (int i = 0; i < 256; i++) {
+            m_endsSymbol[i] = false;
+        }
+        for (const char* p = " \t\n\v\f\r,[]{}()'\"`;"; *p; p++) {
+            m_endsSymbol[static_cast<unsigned char>(*p)] = true;
+        }
+    }
 
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
+    CharClass operator [] (char c) const {
+        return m_table[static_cast<unsigned char>(c)];
+    }
+
+    bool endsSymbol(char c) const {
+        return m_endsSymbol[static_cast<unsigned char>(c)];
+    }
 
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+private:
+    void set(char c, CharClass cc) {
+        m_table[static_cast<unsigned char>(c)] = cc;
+    }
+
+    CharClass m_table[256];
+    bool      m_endsSymbol[256];
 };
 
+static const CharClassTable charClass;
+
 class Tokeniser
 {
 public:
     Tokeniser(const String& input);
 
-    String peek() const {
+    const String& peek() const {
         ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
         return m_token;
     }
 
     String next() {
         ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
-        String ret = peek();
+        String ret;
+        ret.swap(m_token);
         nextToken();
         return ret;
     }
 
     bool eof() const {
-        return m_iter == m_end;
+        return m_token.empty();
     }
 
 private:
     void skipWhitespace();
     void nextToken();
 
-    bool matchRegex(const Regex& regex);
-
     typedef String::const_iterator StringIter;
 
     String      m_token;
@@ -57,59 +106,92 @@ Tokeniser::Tokeniser(const String& input)
     nextToken();
 }
 
-bool Tokeniser::matchRegex(const Regex& regex)
+void Tokeniser::nextToken()
 {
-    if (eof()) {
-        return false;
-    }
+    m_token.clear();
 
-    std::smatch match;
-    auto flags = std::regex_constants::match_continuous;
-    if (!std::regex_search(m_iter, m_end, match, regex, flags)) {
-        return false;
+    skipWhitespace();
+    if (m_iter == m_end) {
+        return;
     }
 
-    ASSERT(match.size() == 1, "Should only have one submatch, not %lu\n",
-                              match.size());
-    ASSERT(match.position(0) == 0, "Need to match first character\n");
-    ASSERT(match.length(0) > 0, "Need to match a non-empty string\n");
-
-    // Don't advance  m_iter now, do it after we've consumed the token in
-    // next().  If we do it now, we hit eof() when there's still one token left.
-    m_token = match.str(0);
+    StringIter start = m_iter;
+    switch (charClass[*m_iter++]) {
+        case CC_TILDE:
+            if ((m_iter != m_end) && (*m_iter == '@')) {
+                ++m_iter;
+            }
+            break;
+
+        case CC_SPECIAL:
+            break;
+
+        case CC_STRING:
+            while (1) {
+                MAL_CHECK(m_iter != m_end, "Expected \", got EOF");
+                char c = *m_iter++;
+                if (c == '"') {
+                    break;
+                }
+                if (c == '\\') {
+                    // A backslash escapes anything except a line end.
+                    MAL_CHECK((m_iter != m_end) &&
+                              (*m_iter != '\n') && (*m_iter != '\r'),
+                              "Expected \", got EOF");
+                    ++m_iter;
+                }
+            }
+            break;
+
+        default:
+            while ((m_iter != m_end) && !charClass.endsSymbol(*m_iter)) {
+                ++m_iter;
+            }
+            break;
+    }
 
-    return true;
+    m_token.assign(start, m_iter);
 }
 
-void Tokeniser::nextToken()
+void Tokeniser::skipWhitespace()
 {
-    m_iter += m_token.size();
-
-    skipWhitespace();
-    if (eof()) {
-        return;
-    }
-
-    for (auto &it : tokenRegexes) {
-        if (matchRegex(it)) {
+    while (m_iter != m_end) {
+        CharClass cc = charClass[*m_iter];
+        if (cc == CC_SPACE) {
+            ++m_iter;
+        }
+        else if (cc == CC_COMMENT) {
+            while ((m_iter != m_end) && (*m_iter != '\n') && (*m_iter != '\r')) {
+                ++m_iter;
+            }
+        }
+        else {
             return;
         }
     }
+}
 
-    String mismatch(m_iter, m_end);
-    if (mismatch[0] == '"') {
-        MAL_CHECK(false, "Expected \", got EOF");
+static bool isInteger(const String& token)
+{
+    auto it = token.begin(), end = token.end();
+    if ((*it == '-') || (*it == '+')) {
+        ++it;
+    }
+    if (it == end) {
+        return false;
     }
-    else {
-        MAL_CHECK(false, "Unexpected \"%s\"", mismatch.c_str());
+    for ( ; it != end; ++it) {
+        if ((*it < '0') || (*it > '9')) {
+            return false;
+        }
     }
+    return true;
 }
 
-void Tokeniser::skipWhitespace()
+static bool isClose(const String& token)
 {
-    while (matchRegex(whitespaceRegex)) {
-        m_iter += m_token.size();
-    }
+    return (token.size() == 1) &&
+           ((token[0] == ')') || (token[0] == ']') || (token[0] == '}'));
 }
 
 static malValuePtr readAtom(Tokeniser& tokeniser);
@@ -130,10 +212,9 @@ malValuePtr readStr(const String& input)
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
     MAL_CHECK(!tokeniser.eof(), "Expected form, got EOF");
-    String token = tokeniser.peek();
+    const String& token = tokeniser.peek();
 
-    MAL_CHECK(!std::regex_match(token, closeRegex),
-            "Unexpected \"%s\"", token.c_str());
+    MAL_CHECK(!isClose(token), "Unexpected \"%s\"", token.c_str());
 
     if (token == "(") {
         tokeniser.next();
@@ -203,7 +284,7 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
             return processMacro(tokeniser, macro.symbol);
         }
     }
-    if (std::regex_match(token, intRegex)) {
+    if (isInteger(token)) {
         return mal::integer(token);
     }
     return mal::symbol(token);
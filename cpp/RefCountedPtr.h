@@ -2,23 +2,103 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "Memory.h"
 
 #include <cstddef>
 
+template<class T> class RefCountedPtr;
+
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    // Only objects which can be part of a cycle need to be traced by the
+    // cycle collector: environments, closures and atoms, and containers
+    // which hold any of them. Strings, numbers, and lists of those can't.
+    explicit RefCounted(bool traced = false)
+    : m_refCount(0), m_colour(Black), m_traced(traced), m_root(0) { }
     virtual ~RefCounted() { }
 
+    POOL_ALLOCATED
+
     const RefCounted* acquire() const { m_refCount++; return this; }
     int release() const { return --m_refCount; }
     int refCount() const { return m_refCount; }
 
+    bool isTraced() const { return m_traced; }
+
+    // Called when a reference is dropped and others remain. If they are
+    // all from a cycle, the object is now garbage, so it is noted as a
+    // root for the cycle collector to look at.
+    void released() const {
+        if (m_traced && (m_root == 0)) {
+            addRoot(this);
+        }
+    }
+
+    // Deletes an object whose last reference has gone. Deleting it releases
+    // whatever it points to, so rather than recursing down a long chain,
+    // objects freed meanwhile are queued and deleted in a loop. A large
+    // structure is freed a batch at a time, spread over later calls, so
+    // that dropping it doesn't stall the program.
+    static void destroy(const RefCounted* object);
+
+    class Visitor {
+    public:
+        virtual void visit(const RefCounted* child) = 0;
+
+        template<class T>
+        void visit(const RefCountedPtr<T>& child) {
+            if (const RefCounted* object = child.ptr()) {
+                visit(object);
+            }
+        }
+    };
+
+    // A traced object must pass every traced object it holds a counted
+    // reference to. Passing one it doesn't hold would free live objects.
+    virtual void visitChildren(Visitor& visitor) const { }
+
+    // Called on garbage found by the cycle collector. Every cycle passes
+    // through something mutable, which drops its references here so that
+    // the rest is freed by reference counting as usual.
+    virtual void dropReferences() { }
+
+    // Synchronous cycle collection, by trial deletion (Bacon and Rajan,
+    // "Concurrent Cycle Collection in Reference Counted Systems", 2001).
+    // Returns the number of objects found to be cyclic garbage.
+    static int collectCycles();
+
+    // Collects once enough roots have been noted. Only call it at a safe
+    // point, where everything in use is held by a counted reference: a
+    // collection frees any cycle that only uncounted pointers still reach.
+    // EVAL calls it at the top of each iteration, as does the VM's run().
+    static void collectCyclesIfDue() {
+        if (s_collectionDue) {
+            collectCycles();
+        }
+    }
+
+protected:
+    // An object can start being traced at any time. Until then the
+    // collector treats its references as coming from outside any cycle.
+    void markTraced() const { m_traced = 1; }
+
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
-    mutable int m_refCount;
+    friend class CycleCollector;
+
+    enum Colour { Black, Grey, White };
+
+    static void addRoot(const RefCounted* object);
+    static void removeRoot(const RefCounted* object);
+    static bool s_collectionDue;
+
+    mutable int      m_refCount;
+    // These fit in the padding after m_refCount.
+    mutable unsigned m_colour : 2;
+    mutable unsigned m_traced : 1;
+    mutable unsigned m_root   : 29; // index in the roots, plus one
 };
 
 template<class T>
@@ -32,11 +112,23 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    RefCountedPtr(RefCountedPtr&& rhs) : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        // rhs may be owned by our current object, so detach it first.
+        T* object = rhs.m_object;
+        rhs.m_object = 0;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -57,6 +149,8 @@ public:
     T* ptr() const { return m_object; }
 
 private:
+    // Takes the new object before letting go of the old one, as the old one
+    // may be all that is keeping the new one alive.
     void acquire(T* object) {
         if (object != NULL) {
             object->acquire();
@@ -66,8 +160,13 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if (m_object != NULL) {
+            if (m_object->release() == 0) {
+                RefCounted::destroy(m_object);
+            }
+            else {
+                m_object->released();
+            }
         }
     }
 
@@ -1,12 +1,17 @@
+#include "ArgStack.h"
 #include "Debug.h"
 #include "Environment.h"
 #include "Types.h"
 
 #include <algorithm>
 #include <memory>
-#include <typeinfo>
+#include <unordered_map>
 
 namespace mal {
+    malValuePtr analysedList(malValueVec* items, malValuePtr source) {
+        return malValuePtr(new malAnalysedList(items, source));
+    }
+
     malValuePtr atom(malValuePtr value) {
         return malValuePtr(new malAtom(value));
     };
@@ -25,7 +30,7 @@ namespace mal {
     };
 
 
-    malValuePtr hash(const malHash::Map& map) {
+    malValuePtr hash(const PersistentMap& map) {
         return malValuePtr(new malHash(map));
     }
 
@@ -34,12 +39,23 @@ namespace mal {
         return malValuePtr(new malHash(argsBegin, argsEnd, isEvaluated));
     }
 
-    malValuePtr integer(int value) {
+    malValuePtr integer(int64_t value) {
+        if (malValuePtr::canHoldInteger(value)) {
+            return malValuePtr::fromInteger(value);
+        }
         return malValuePtr(new malInteger(value));
     };
 
+    malValuePtr integer(const BigInt& value) {
+        int64_t small;
+        if (value.toInt64(small)) {
+            return integer(small);
+        }
+        return malValuePtr(new malBigInteger(value));
+    }
+
     malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        return integer(BigInt::parse(token));
     };
 
     malValuePtr keyword(const String& token) {
@@ -51,6 +67,11 @@ namespace mal {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lambda(const malSymbolVec& bindings,
+                       malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(bindings, body, env));
+    }
+
     malValuePtr list(malValueVec* items) {
         return malValuePtr(new malList(items));
     };
@@ -80,6 +101,10 @@ namespace mal {
         return malValuePtr(new malList(items));
     }
 
+    malValuePtr local(malSymbol* symbol, int depth, int slot) {
+        return malValuePtr(new malLocal(symbol, depth, slot));
+    }
+
     malValuePtr macro(const malLambda& lambda) {
         return malValuePtr(new malLambda(lambda, true));
     };
@@ -94,7 +119,18 @@ namespace mal {
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        // Symbols are interned, so each name has a single malSymbol. The
+        // table keeps them alive for the lifetime of the program.
+        typedef std::unordered_map<String, malValuePtr> SymbolTable;
+        static SymbolTable table;
+
+        auto it = table.find(token);
+        if (it != table.end()) {
+            return it->second;
+        }
+        malValuePtr sym(new malSymbol(token));
+        table.insert(std::make_pair(token, sym));
+        return sym;
     };
 
     malValuePtr trueValue() {
@@ -113,55 +149,63 @@ namespace mal {
 
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd,
-                              malEnvPtr env) const
+                              malEnvRef env) const
 {
     return m_handler(m_name, argsBegin, argsEnd, env);
 }
 
-static String makeHashKey(malValuePtr key)
+// Hash keys must be strings or keywords.
+static malValueRef checkKey(malValueRef key)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
+    if (!key.isInteger() && ((key->tag() == malValue::STRING) ||
+                             (key->tag() == malValue::KEYWORD))) {
+        return key;
     }
     MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+static PersistentMap addToMap(PersistentMap map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        malValueRef key = checkKey(*it++);
+        map.assocInPlace(key, *it);
     }
 
     return map;
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+static PersistentMap createMap(malValueIter argsBegin, malValueIter argsEnd)
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "hash-map requires an even-sized list");
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    return addToMap(PersistentMap(), argsBegin, argsEnd);
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(HASH)
+, m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
 {
-
+    traceMap();
 }
 
-malHash::malHash(const malHash::Map& map)
-: m_map(map)
+malHash::malHash(const PersistentMap& map)
+: malValue(HASH)
+, m_map(map)
 , m_isEvaluated(true)
 {
+    traceMap();
+}
 
+void malHash::traceMap() const
+{
+    // Map nodes are always traced.
+    if (m_map.count() > 0) {
+        markTraced();
+    }
 }
 
 malValuePtr
@@ -170,76 +214,81 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    return mal::hash(addToMap(m_map, argsBegin, argsEnd));
 }
 
-bool malHash::contains(malValuePtr key) const
+bool malHash::contains(malValueRef key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return m_map.find(checkKey(key)) != NULL;
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    PersistentMap map(m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map = map.dissoc(checkKey(*it));
     }
     return mal::hash(map);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+malValuePtr malHash::eval(malEnvRef env)
 {
     if (m_isEvaluated) {
         return malValuePtr(this);
     }
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
-    }
+    PersistentMap map;
+    m_map.forEach([&](malValueRef key, malValueRef value) {
+        map.assocInPlace(key, EVAL(value, env));
+    });
     return mal::hash(map);
 }
 
-malValuePtr malHash::get(malValuePtr key) const
+malValuePtr malHash::get(malValueRef key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malValuePtr* value = m_map.find(checkKey(key));
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
 {
     malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
-    }
+    keys->reserve(m_map.count());
+    m_map.forEach([&](malValueRef key, malValueRef) {
+        keys->push_back(key);
+    });
     return mal::list(keys);
 }
 
 malValuePtr malHash::values() const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
-    }
-    return mal::list(keys);
+    malValueVec* values = new malValueVec();
+    values->reserve(m_map.count());
+    m_map.forEach([&](malValueRef, malValueRef value) {
+        values->push_back(value);
+    });
+    return mal::list(values);
 }
 
 String malHash::print(bool readably) const
 {
+    // Print the entries sorted by key, so that the output doesn't depend
+    // on the keys' hashes.
+    typedef std::pair<String, malValuePtr> Entry;
+    std::vector<Entry> entries;
+    entries.reserve(m_map.count());
+    m_map.forEach([&](malValueRef key, malValueRef value) {
+        entries.push_back(Entry(key->print(true), value));
+    });
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& lhs, const Entry& rhs) {
+                  return lhs.first < rhs.first;
+              });
+
     String s = "{";
 
-    auto it = m_map.begin(), end = m_map.end();
+    auto it = entries.begin(), end = entries.end();
     if (it != end) {
         s += it->first + " " + it->second->print(readably);
         ++it;
@@ -253,27 +302,43 @@ String malHash::print(bool readably) const
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    const PersistentMap& r_map = static_cast<const malHash*>(rhs)->m_map;
+    if (m_map.count() != r_map.count()) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
+    bool isEqual = true;
+    m_map.forEach([&](malValueRef key, malValueRef value) {
+        const malValuePtr* r_value = isEqual ? r_map.find(key) : NULL;
+        isEqual = r_value && value->isEqualTo(*r_value);
+    });
+    return isEqual;
+}
 
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
-            return false;
-        }
+static malSymbolVec internAll(const StringVec& names)
+{
+    malSymbolVec symbols;
+    for (auto it = names.begin(), end = names.end(); it != end; ++it) {
+        symbols.push_back(STATIC_CAST(malSymbol, mal::symbol(*it)));
     }
-    return true;
+    return symbols;
 }
 
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+: malApplicable(LAMBDA)
+, m_bindings(internAll(bindings))
+, m_body(body)
+, m_env(env)
+, m_isMacro(false)
+{
+
+}
+
+malLambda::malLambda(const malSymbolVec& bindings,
+                     malValuePtr body, malEnvPtr env)
+: malApplicable(LAMBDA)
+, m_bindings(bindings)
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
@@ -282,7 +347,7 @@ malLambda::malLambda(const StringVec& bindings,
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+: malApplicable(LAMBDA, meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
@@ -292,7 +357,7 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(LAMBDA, that.m_meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
@@ -301,9 +366,16 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 
 }
 
+void malLambda::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    visitor.visit(m_body);
+    visitor.visit(m_env);
+}
+
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd,
-                             malEnvPtr) const
+                             malEnvRef) const
 {
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
@@ -318,6 +390,8 @@ malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+unsigned malAnalysedList::s_macroEpoch = 0;
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
@@ -331,7 +405,7 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr malList::eval(malEnvRef env)
 {
     // Note, this isn't actually called since the TCO updates, but
     // is required for the earlier steps, so don't get rid of it.
@@ -339,10 +413,72 @@ malValuePtr malList::eval(malEnvPtr env)
         return malValuePtr(this);
     }
 
-    std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
-    malValuePtr op = *it;
-    return APPLY(op, ++it, items->end(), env);
+    malArgStack::Frame items(count());
+    evalItems(env, items.begin());
+    return APPLY(items[0], items.begin() + 1, items.end(), env);
+}
+
+malValuePtr malLocal::eval(malEnvRef env)
+{
+    if (m_slot >= 0) {
+        return env->get(m_depth, m_slot);
+    }
+    malEnv* frame = env->frame(m_depth);
+    if (frame != m_global) {
+        malValuePtr* value = frame->globalValue(m_symbol->interned());
+        if (!value) {
+            return frame->get(m_symbol.ptr());
+        }
+        m_global = frame;
+        m_value  = value;
+    }
+    return *m_value;
+}
+
+void malTemplate::add(Kind kind, malValuePtr form)
+{
+    if (isTracedValue(form)) {
+        markTraced();
+    }
+    m_forms.push_back(form);
+    m_kinds.push_back(kind);
+}
+
+malValuePtr malTemplate::build(malValueIter values) const
+{
+    int count = 0;
+    auto value = values;
+    for (auto kind : m_kinds) {
+        count += (kind == SPLICED)
+               ? VALUE_CAST(malSequence, *value)->count() : 1;
+        ++value;
+    }
+
+    malValueVec* items = new malValueVec;
+    items->reserve(count);
+    value = values;
+    for (auto kind : m_kinds) {
+        if (kind == SPLICED) {
+            const malSequence* seq = STATIC_CAST(malSequence, *value);
+            items->insert(items->end(), seq->begin(), seq->end());
+        }
+        else {
+            items->push_back(*value);
+        }
+        ++value;
+    }
+    return mal::list(items);
+}
+
+malValuePtr malTemplate::eval(malEnvRef env)
+{
+    int count = m_forms.size();
+    malArgStack::Frame values(count);
+    for (int i = 0; i < count; i++) {
+        values[i] = (m_kinds[i] == QUOTED) ? m_forms[i]
+                                           : EVAL(m_forms[i], env);
+    }
+    return build(values.begin());
 }
 
 String malList::print(bool readably) const
@@ -350,18 +486,37 @@ String malList::print(bool readably) const
     return '(' + malSequence::print(readably) + ')';
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+malValuePtr malInteger::eval(malEnvRef env)
+{
+    // This may be a temporary box for an integer held in a malValuePtr, in
+    // which case it mustn't be returned.
+    if (!m_meta) {
+        return mal::integer(m_value);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malValue::eval(malEnvRef env)
 {
     // Default case of eval is just to return the object itself.
     return malValuePtr(this);
 }
 
+bool malValue::isEqualTo(const malValuePtr& rhs) const
+{
+    return isEqualTo(malValueBox(rhs).get());
+}
+
+static bool isSequence(malValue::Tag tag)
+{
+    return (tag >= malSequence::FirstTag) && (tag <= malSequence::LastTag);
+}
+
 bool malValue::isEqualTo(const malValue* rhs) const
 {
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (tag() == rhs->tag()) ||
+        (isSequence(tag()) && isSequence(rhs->tag()));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
@@ -372,9 +527,21 @@ bool malValue::isTrue() const
         && (this != mal::nilValue().ptr());
 }
 
+LiveCount malValue::s_counts[malValue::Tags];
+
+const char* malValue::tagName(Tag tag)
+{
+    static const char* names[Tags] = {
+        "constant", "integer", "big-integer", "string", "keyword", "symbol",
+        "local", "template", "list", "analysed-list", "vector", "hash",
+        "builtin", "lambda", "atom", "code",
+    };
+    return names[tag];
+}
+
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_meta ? m_meta : mal::nilValue();
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -382,28 +549,111 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+void malValue::visitChildren(Visitor& visitor) const
+{
+    visitor.visit(m_meta);
+}
+
+malSequence::malSequence(Tag tag, malValueVec* items)
+: malValue(tag)
+, m_items(items)
+, m_begin(m_items->begin())
+, m_end(m_items->end())
+, m_lazyItems(NULL)
 {
+    traceItems();
+}
 
+malSequence::malSequence(Tag tag, malValueIter begin, malValueIter end)
+: malValue(tag)
+, m_items(new malValueVec(begin, end))
+, m_begin(m_items->begin())
+, m_end(m_items->end())
+, m_lazyItems(NULL)
+{
+    traceItems();
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+void malSequence::traceItems() const
 {
+    for (auto it = m_begin; it != m_end; ++it) {
+        if (isTracedValue(*it)) {
+            markTraced();
+            return;
+        }
+    }
+}
 
+void malSequence::realiseItems() const
+{
+    m_items = new malValueVec(m_lazyItems->count());
+    m_lazyItems->copyTo(m_items->begin());
+    m_begin = m_items->begin();
+    m_end   = m_items->end();
+    m_lazyItems = NULL;
+}
+
+malValuePtr malSequence::itemsOwner() const
+{
+    return m_owner ? m_owner : malValuePtr(const_cast<malSequence*>(this));
+}
+
+malSequence::malSequence(Tag tag, const malSequence& that,
+                         malValueIter begin, malValueIter end)
+: malValue(tag)
+, m_items(that.m_items)
+, m_owner(that.itemsOwner())
+, m_begin(begin)
+, m_end(end)
+, m_lazyItems(NULL)
+{
+    // A view holds on to all of its owner's items, not just its own.
+    if (m_owner->isTraced()) {
+        markTraced();
+    }
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+: malValue(that.tag(), meta)
+, m_items(that.realisedItems())
+, m_owner(that.itemsOwner())
+, m_begin(that.m_begin)
+, m_end(that.m_end)
+, m_lazyItems(NULL)
+{
+    if (m_owner->isTraced()) {
+        markTraced();
+    }
+}
+
+malSequence::malSequence(Tag tag, malValuePtr meta,
+                         const PersistentVector* items)
+: malValue(tag, meta)
+, m_items(NULL)
+, m_lazyItems(items)
 {
 
 }
 
+void malSequence::visitChildren(Visitor& visitor) const
+{
+    malValue::visitChildren(visitor);
+    if (m_owner) {
+        visitor.visit(m_owner);
+    }
+    else if (m_items) {
+        // All of them, not just this sequence's range: it owns them all.
+        for (auto& item : *m_items) {
+            visitor.visit(item);
+        }
+    }
+}
+
 malSequence::~malSequence()
 {
-    delete m_items;
+    if (!m_owner) {
+        delete m_items;
+    }
 }
 
 bool malSequence::doIsEqualTo(const malValue* rhs) const
@@ -413,27 +663,34 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = begin(),
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      end = this->end(); it0 != end; ++it0, ++it1) {
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
+        if (! (*it0)->isEqualTo(*it1)) {
             return false;
         }
     }
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+malValueVec* malSequence::evalItems(malEnvRef env) const
 {
     malValueVec* items = new malValueVec;;
     items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+    for (auto it = begin(), end = this->end(); it != end; ++it) {
         items->push_back(EVAL(*it, env));
     }
     return items;
 }
 
+void malSequence::evalItems(malEnvRef env, malValueIter dest) const
+{
+    for (auto it = begin(), end = this->end(); it != end; ++it) {
+        *dest++ = EVAL(*it, env);
+    }
+}
+
 malValuePtr malSequence::first() const
 {
     return count() == 0 ? mal::nilValue() : item(0);
@@ -442,8 +699,8 @@ malValuePtr malSequence::first() const
 String malSequence::print(bool readably) const
 {
     String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = this->end();
+    auto it = begin();
     if (it != end) {
         str += (*it)->print(readably);
         ++it;
@@ -457,8 +714,22 @@ String malSequence::print(bool readably) const
 
 malValuePtr malSequence::rest() const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    if (count() <= 1) {
+        return mal::list(new malValueVec);
+    }
+    // Share our items rather than copying them, so that walking down a
+    // sequence with rest is linear, not quadratic.
+    return malValuePtr(new malList(*this, begin() + 1, end()));
+}
+
+uint32_t malStringBase::hashValue() const
+{
+    // FNV-1a, seeded with the tag so that "a" and :a hash differently.
+    uint32_t hash = 2166136261u ^ tag();
+    for (auto it = m_value.begin(), end = m_value.end(); it != end; ++it) {
+        hash = (hash ^ (unsigned char)*it) * 16777619u;
+    }
+    return hash;
 }
 
 String malString::escapedValue() const
@@ -471,25 +742,105 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+static malSymbol::Special specialFor(const String& token)
+{
+    struct SpecialForm {
+        const char*         name;
+        malSymbol::Special  special;
+    };
+    static const SpecialForm specialTable[] = {
+        { "catch*",         malSymbol::CATCH },
+        { "def!",           malSymbol::DEF },
+        { "defmacro!",      malSymbol::DEFMACRO },
+        { "do",             malSymbol::DO },
+        { "fn*",            malSymbol::FN },
+        { "if",             malSymbol::IF },
+        { "let*",           malSymbol::LET },
+        { "macroexpand",    malSymbol::MACROEXPAND },
+        { "quasiquote",     malSymbol::QUASIQUOTE },
+        { "quote",          malSymbol::QUOTE },
+        { "splice-unquote", malSymbol::SPLICE_UNQUOTE },
+        { "try*",           malSymbol::TRY },
+        { "unquote",        malSymbol::UNQUOTE },
+    };
+
+    for (auto &form : specialTable) {
+        if (token == form.name) {
+            return form.special;
+        }
+    }
+    return malSymbol::NONE;
+}
+
+malSymbol::malSymbol(const String& token)
+: malStringBase(SYMBOL, token)
+, m_special(specialFor(token))
+, m_interned(this)
+{
+
+}
+
+malValuePtr malSymbol::eval(malEnvRef env)
+{
+    return env->get(this);
+}
+
+malVector::malVector(const PersistentVector& items, malValuePtr meta)
+: malSequence(VECTOR, meta, &m_trie)
+, m_trie(items)
+, m_hasTrie(true)
+{
+    if (items.isTraced()) {
+        markTraced();
+    }
+}
+
+malValuePtr malVector::doWithMeta(malValuePtr meta) const
 {
-    return env->get(value());
+    if (m_hasTrie) {
+        return new malVector(m_trie, meta);
+    }
+    return new malVector(*this, meta);
+}
+
+void malVector::visitChildren(Visitor& visitor) const
+{
+    malSequence::visitChildren(visitor);
+    m_trie.visitNodes(visitor);
+}
+
+const PersistentVector& malVector::trie() const
+{
+    if (!m_hasTrie) {
+        m_trie = PersistentVector(begin(), end());
+        m_hasTrie = true;
+    }
+    return m_trie;
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
+    int oldItemCount = count();
     int newItemCount = std::distance(argsBegin, argsEnd);
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+    // Small vectors are cheap enough to copy, and stay as flat arrays.
+    if (oldItemCount + newItemCount <= PersistentVector::Width) {
+        malValueVec* items = new malValueVec(oldItemCount + newItemCount);
+        std::copy(begin(), end(), items->begin());
+        std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
 
-    return mal::vector(items);
+        return mal::vector(items);
+    }
+
+    PersistentVector items = trie();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.conj(*it);
+    }
+    return malValuePtr(new malVector(items));
 }
 
-malValuePtr malVector::eval(malEnvPtr env)
+malValuePtr malVector::eval(malEnvRef env)
 {
     return mal::vector(evalItems(env));
 }
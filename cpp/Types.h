@@ -2,22 +2,53 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "BigInt.h"
+#include "PersistentMap.h"
+#include "PersistentVector.h"
 
 #include <exception>
-#include <map>
+#include <new>
+#include <type_traits>
 
 class malEmptyInputException : public std::exception { };
 
 class malValue : public RefCounted {
 public:
-    malValue() {
+    // Each concrete class has its own tag. Subclasses of an abstract class
+    // have consecutive tags, so that DYNAMIC_CAST is a range check.
+    enum Tag {
+        CONSTANT,
+        INTEGER,
+        BIG_INTEGER,
+        STRING,
+        KEYWORD,
+        SYMBOL,
+        LOCAL,
+        TEMPLATE,
+        LIST,
+        ANALYSED_LIST,
+        VECTOR,
+        HASH,
+        BUILTIN,
+        LAMBDA,
+        ATOM,
+        CODE,
+    };
+    static const int Tags = CODE + 1;  // CODE is the last tag
+
+    malValue(Tag tag) : RefCounted(isAlwaysTraced(tag)), m_tag(tag) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        s_counts[tag].created();
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(Tag tag, malValuePtr meta)
+    : RefCounted(isAlwaysTraced(tag) || isTracedValue(meta))
+    , m_meta(meta), m_tag(tag) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        s_counts[tag].created();
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
+        s_counts[m_tag].destroyed();
     }
 
     malValuePtr withMeta(malValuePtr meta) const;
@@ -27,29 +58,57 @@ public:
     bool isTrue() const;
 
     bool isEqualTo(const malValue* rhs) const;
+    bool isEqualTo(const malValuePtr& rhs) const;
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(malEnvRef env);
 
     virtual String print(bool readably) const = 0;
 
+    Tag tag() const { return m_tag; }
+
+    // The values with a tag which are alive now, and the most there have
+    // been at once, and the tag's name for printing them.
+    static const LiveCount& liveCount(Tag tag) { return s_counts[tag]; }
+    static const char* tagName(Tag tag);
+
+    virtual void visitChildren(Visitor& visitor) const;
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    // Closures and atoms can always be part of a cycle. Containers can if
+    // they hold anything which can, which they check when they are made.
+    static bool isAlwaysTraced(Tag tag) {
+        return (tag == LAMBDA) || (tag == ATOM);
+    }
+    static bool isTracedValue(malValueRef value);
+
     malValuePtr m_meta;
+
+private:
+    const Tag m_tag;
+
+    static LiveCount s_counts[Tags];
 };
 
 template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
-    MAL_CHECK(dest != NULL, "%s is not a %s",
-              obj->print(true).c_str(), typeName);
-    return dest;
+T* tag_cast(malValue* value) {
+    if ((value != NULL) && (value->tag() >= T::FirstTag)
+                        && (value->tag() <= T::LastTag)) {
+        return static_cast<T*>(value);
+    }
+    return NULL;
 }
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  (tag_cast<Type>((Value).ptr()))
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
+// The range of tags for a class and its subclasses.
+#define TAGS(First, Last) \
+    static const Tag FirstTag = First; \
+    static const Tag LastTag  = Last
+
 #define WITH_META(Type) \
     virtual malValuePtr doWithMeta(malValuePtr meta) const { \
         return new Type(*this, meta); \
@@ -57,9 +116,11 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    TAGS(CONSTANT, CONSTANT);
+
+    malConstant(String name) : malValue(CONSTANT), m_name(name) { }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(CONSTANT, meta), m_name(that.m_name) { }
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -75,15 +136,19 @@ private:
 
 class malInteger : public malValue {
 public:
-    malInteger(int value) : m_value(value) { }
+    TAGS(INTEGER, INTEGER);
+
+    malInteger(int64_t value) : malValue(INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(INTEGER, meta), m_value(that.m_value) { }
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
     }
 
-    int value() const { return m_value; }
+    int64_t value() const { return m_value; }
+
+    virtual malValuePtr eval(malEnvRef env);
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
@@ -92,28 +157,180 @@ public:
     WITH_META(malInteger);
 
 private:
-    const int m_value;
+    const int64_t m_value;
 };
 
+// Integers which don't fit in 64 bits. Arithmetic results are normalised,
+// so a malBigInteger is never equal to a malInteger.
+class malBigInteger : public malValue {
+public:
+    TAGS(BIG_INTEGER, BIG_INTEGER);
+
+    malBigInteger(const BigInt& value)
+        : malValue(BIG_INTEGER), m_value(value) { }
+    malBigInteger(const malBigInteger& that, malValuePtr meta)
+        : malValue(BIG_INTEGER, meta), m_value(that.m_value) { }
+
+    virtual String print(bool readably) const {
+        return m_value.toString();
+    }
+
+    const BigInt& value() const { return m_value; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_value == static_cast<const malBigInteger*>(rhs)->m_value;
+    }
+
+    WITH_META(malBigInteger);
+
+private:
+    const BigInt m_value;
+};
+
+// What operator-> on a malValuePtr returns. If the pointer holds an integer,
+// it's boxed in a malInteger which lives here, until the end of the full
+// expression, so nothing may keep hold of it.
+class malValueBox {
+public:
+    explicit malValueBox(const malValuePtr& value) {
+        if (value.isInteger()) {
+            m_ptr = new (&m_storage) malInteger(value.integerValue());
+        }
+        else {
+            m_ptr = value.ptr();
+        }
+    }
+
+    malValueBox(const malValueBox& that) {
+        if (that.isBoxed()) {
+            m_ptr = new (&m_storage)
+                malInteger(static_cast<malInteger*>(that.m_ptr)->value());
+        }
+        else {
+            m_ptr = that.m_ptr;
+        }
+    }
+
+    ~malValueBox() {
+        if (isBoxed()) {
+            static_cast<malInteger*>(m_ptr)->~malInteger();
+        }
+    }
+
+    malValue* operator -> () const { return m_ptr; }
+    malValue* get() const { return m_ptr; }
+
+private:
+    malValueBox& operator = (const malValueBox&); // no assignments
+
+    bool isBoxed() const {
+        return m_ptr == reinterpret_cast<const malValue*>(&m_storage);
+    }
+
+    malValue* m_ptr;
+    std::aligned_storage<sizeof(malInteger), alignof(malInteger)>::type
+        m_storage;
+};
+
+inline RefCountedPtr<malValue>::RefCountedPtr(malValue* object)
+: m_bits(reinterpret_cast<uintptr_t>(static_cast<RefCounted*>(object)))
+{
+    acquire();
+}
+
+inline malValueBox RefCountedPtr<malValue>::operator -> () const
+{
+    return malValueBox(*this);
+}
+
+inline malValue* RefCountedPtr<malValue>::ptr() const
+{
+    if (isInteger()) {
+        return NULL;
+    }
+    return static_cast<malValue*>(const_cast<RefCounted*>(object()));
+}
+
+inline bool malValue::isTracedValue(malValueRef value)
+{
+    const malValue* object = value.ptr();
+    return (object != NULL) && object->isTraced();
+}
+
+template<class T>
+T* value_cast(malValuePtr obj, const char* typeName) {
+    T* dest = tag_cast<T>(obj.ptr());
+    MAL_CHECK(dest != NULL, "%s is not a %s",
+              obj->print(true).c_str(), typeName);
+    return dest;
+}
+
+inline int64_t toInteger(const malValuePtr& obj)
+{
+    if (obj.isInteger()) {
+        return obj.integerValue();
+    }
+    return VALUE_CAST(malInteger, obj)->value();
+}
+
+// Sets value and returns true if obj is an integer which fits in 64 bits.
+inline bool isInt64(const malValuePtr& obj, int64_t& value)
+{
+    if (obj.isInteger()) {
+        value = obj.integerValue();
+        return true;
+    }
+    if (const malInteger* i = DYNAMIC_CAST(malInteger, obj)) {
+        value = i->value();
+        return true;
+    }
+    return false;
+}
+
+inline BigInt toBigInt(const malValuePtr& obj)
+{
+    if (const malBigInteger* big = DYNAMIC_CAST(malBigInteger, obj)) {
+        return big->value();
+    }
+    return BigInt(toInteger(obj));
+}
+
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    TAGS(STRING, SYMBOL);
+
+    malStringBase(Tag tag, const String& token)
+        : malValue(tag), m_value(token), m_hash(0) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.tag(), meta), m_value(that.value())
+        , m_hash(that.m_hash) { }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    // A hash of the tag and value, for malHash keys. It's worked out the
+    // first time it's asked for.
+    uint32_t hash() const {
+        if (m_hash == 0) {
+            m_hash = hashValue();
+        }
+        return m_hash;
+    }
 
 private:
+    uint32_t hashValue() const;
+
     const String m_value;
+    mutable uint32_t m_hash;
 };
 
 class malString : public malStringBase {
 public:
+    TAGS(STRING, STRING);
+
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(STRING, token) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
@@ -130,8 +347,10 @@ public:
 
 class malKeyword : public malStringBase {
 public:
+    TAGS(KEYWORD, KEYWORD);
+
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(KEYWORD, token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
@@ -144,36 +363,182 @@ public:
 
 class malSymbol : public malStringBase {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
+    // Symbols which EVAL handles specially are tagged when they are created,
+    // so that EVAL can dispatch on the tag rather than comparing strings.
+    TAGS(SYMBOL, SYMBOL);
+
+    enum Special {
+        NONE,
+        CATCH,
+        DEF,
+        DEFMACRO,
+        DO,
+        FN,
+        IF,
+        LET,
+        MACROEXPAND,
+        QUASIQUOTE,
+        QUOTE,
+        SPLICE_UNQUOTE,
+        TRY,
+        UNQUOTE,
+    };
+
+    malSymbol(const String& token);
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_special(that.m_special)
+        , m_interned(that.m_interned) { }
+
+    virtual malValuePtr eval(malEnvRef env);
 
-    virtual malValuePtr eval(malEnvPtr env);
+    Special special() const { return m_special; }
+
+    // The symbol held in the intern table, which differs from this one only
+    // if this is a copy made by with-meta.
+    const malSymbol* interned() const { return m_interned; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return (this == rhs) ||
+            (value() == static_cast<const malSymbol*>(rhs)->value());
     }
 
     WITH_META(malSymbol);
+
+private:
+    const Special    m_special;
+    const malSymbol* m_interned;
+};
+
+// A reference to a variable, which the analyser has resolved to a frame
+// depth and a slot within that frame. Free variables have no slot, and are
+// looked up by name starting from the frame at that depth.
+//
+// When that frame is the global environment, which is where builtins and
+// top-level functions are found, the reference caches where the value is
+// kept there. The global environment lasts as long as the program, and has
+// nothing outside it to be shadowed by; def! updates the value in place.
+class malLocal : public malValue {
+public:
+    TAGS(LOCAL, LOCAL);
+
+    malLocal(malSymbol* symbol, int depth, int slot)
+        : malValue(LOCAL), m_symbol(symbol), m_depth(depth), m_slot(slot)
+        , m_global(NULL), m_value(NULL) { }
+    malLocal(const malLocal& that, malValuePtr meta)
+        : malValue(LOCAL, meta), m_symbol(that.m_symbol)
+        , m_depth(that.m_depth), m_slot(that.m_slot)
+        , m_global(NULL), m_value(NULL) { }
+
+    virtual malValuePtr eval(malEnvRef env);
+
+    virtual String print(bool readably) const {
+        return m_symbol->print(readably);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malLocal);
+
+private:
+    const RefCountedPtr<malSymbol> m_symbol;
+    const int                      m_depth;
+    const int                      m_slot;
+    const malEnv*                  m_global;  // where m_value was found
+    malValuePtr*                   m_value;
+};
+
+// A quasiquote template, made once by the analyser or the compiler, so that
+// each evaluation builds the list straight into a vector of the right size
+// rather than through calls to cons and concat. Each part is an item, quoted
+// or evaluated, or a sequence to splice in.
+class malTemplate : public malValue {
+public:
+    TAGS(TEMPLATE, TEMPLATE);
+
+    enum Kind : uint8_t { QUOTED, UNQUOTED, SPLICED };
+
+    malTemplate() : malValue(TEMPLATE) { }
+    malTemplate(const malTemplate& that, malValuePtr meta)
+        : malValue(TEMPLATE, meta), m_forms(that.m_forms)
+        , m_kinds(that.m_kinds) {
+        if (that.isTraced()) {
+            markTraced();
+        }
+    }
+
+    void add(Kind kind, malValuePtr form);
+
+    int count() const { return m_forms.size(); }
+    Kind kind(int index) const { return m_kinds[index]; }
+    malValuePtr form(int index) const { return m_forms[index]; }
+
+    // Builds the list from the values of the parts, in order.
+    malValuePtr build(malValueIter values) const;
+
+    virtual malValuePtr eval(malEnvRef env);
+
+    virtual String print(bool readably) const {
+        return STRF("#template(%p)", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual void visitChildren(Visitor& visitor) const {
+        malValue::visitChildren(visitor);
+        for (auto& form : m_forms) {
+            visitor.visit(form);
+        }
+    }
+
+    WITH_META(malTemplate);
+
+private:
+    malValueVec       m_forms;
+    std::vector<Kind> m_kinds;
 };
 
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
+    TAGS(LIST, VECTOR);
+
+    malSequence(Tag tag, malValueVec* items);
+    malSequence(Tag tag, malValueIter begin, malValueIter end);
+    malSequence(Tag tag, const malSequence& that,
+                malValueIter begin, malValueIter end);
     malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
+protected:
+    // A sequence whose items live in a PersistentVector. They are copied
+    // out into a malValueVec the first time anything iterates over them.
+    malSequence(Tag tag, malValuePtr meta, const PersistentVector* items);
+
+    // For subclasses which never have lazy items.
+    int flatCount() const { return m_end - m_begin; }
+    malValueRef flatItem(int index) const { return m_begin[index]; }
+    malValueIter flatBegin() const { return m_begin; }
+    malValueIter flatEnd()   const { return m_end; }
+
+public:
+
     virtual String print(bool readably) const;
 
-    malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    malValueVec* evalItems(malEnvRef env) const;
+    void evalItems(malEnvRef env, malValueIter dest) const;
+    int count() const {
+        return m_lazyItems ? m_lazyItems->count() : m_end - m_begin;
+    }
+    bool isEmpty() const { return count() == 0; }
+    malValueRef item(int index) const {
+        return m_lazyItems ? m_lazyItems->item(index) : m_begin[index];
+    }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { realise(); return m_begin; }
+    malValueIter end()   const { realise(); return m_end; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
@@ -183,20 +548,57 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    virtual void visitChildren(Visitor& visitor) const;
+
 private:
-    malValueVec* const m_items;
+    // Items are never changed once a sequence is built, so sequences can
+    // share them. A sequence either owns its items, or is a view onto a
+    // range of the items of the sequence which does, and keeps that alive
+    // through m_owner.
+    malValuePtr itemsOwner() const;
+
+    void realise() const {
+        if (m_lazyItems) {
+            realiseItems();
+        }
+    }
+    void realiseItems() const;
+    malValueVec* realisedItems() const { realise(); return m_items; }
+    void traceItems() const;
+
+    mutable malValueVec*  m_items;
+    const malValuePtr     m_owner;
+    mutable malValueIter  m_begin;
+    mutable malValueIter  m_end;
+    mutable const PersistentVector* m_lazyItems;
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    TAGS(LIST, ANALYSED_LIST);
+
+    malList(malValueVec* items) : malSequence(LIST, items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(LIST, begin, end) { }
     malList(const malList& that, malValuePtr meta)
         : malSequence(that, meta) { }
+    malList(const malSequence& that, malValueIter begin, malValueIter end)
+        : malSequence(LIST, that, begin, end) { }
+
+protected:
+    malList(Tag tag, malValueVec* items) : malSequence(tag, items) { }
+
+public:
+    // Lists are never lazy, so these skip malSequence's check for that.
+    // EVAL looks at lists' items a lot.
+    int count() const { return flatCount(); }
+    bool isEmpty() const { return flatCount() == 0; }
+    malValueRef item(int index) const { return flatItem(index); }
+    malValueIter begin() const { return flatBegin(); }
+    malValueIter end()   const { return flatEnd(); }
 
     virtual String print(bool readably) const;
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(malEnvRef env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
@@ -204,58 +606,128 @@ public:
     WITH_META(malList);
 };
 
+// A list which has been rewritten by the analyser. It evaluates just like
+// the list it came from, which it keeps so that macros can be given the
+// original code if the head of the list turns out to be a macro.
+//
+// The analyser expands macro calls as it goes, so the list is only good
+// while the macros stay as they were. Defining or redefining a macro moves
+// the epoch on, and the lists analysed before then go back to their source.
+class malAnalysedList : public malList {
+public:
+    TAGS(ANALYSED_LIST, ANALYSED_LIST);
+
+    malAnalysedList(malValueVec* items, malValuePtr source)
+        : malList(ANALYSED_LIST, items), m_source(source)
+        , m_epoch(s_macroEpoch) {
+        if (isTracedValue(source)) {
+            markTraced();
+        }
+    }
+    malAnalysedList(const malAnalysedList& that, malValuePtr meta)
+        : malList(that, meta), m_source(that.m_source)
+        , m_epoch(that.m_epoch) { }
+
+    malValuePtr source() const { return m_source; }
+
+    bool isCurrent() const { return m_epoch == s_macroEpoch; }
+    static unsigned macroEpoch() { return s_macroEpoch; }
+    static void macrosChanged() { s_macroEpoch++; }
+
+    virtual void visitChildren(Visitor& visitor) const {
+        malList::visitChildren(visitor);
+        visitor.visit(m_source);
+    }
+
+    WITH_META(malAnalysedList);
+
+private:
+    const malValuePtr m_source;
+    const unsigned    m_epoch;
+
+    static unsigned s_macroEpoch;
+};
+
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    TAGS(VECTOR, VECTOR);
+
+    malVector(malValueVec* items)
+        : malSequence(VECTOR, items), m_hasTrie(false) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(VECTOR, begin, end), m_hasTrie(false) { }
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, meta), m_hasTrie(false) { }
+    malVector(const PersistentVector& items, malValuePtr meta = NULL);
 
-    virtual malValuePtr eval(malEnvPtr env);
+    virtual malValuePtr eval(malEnvRef env);
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
-    WITH_META(malVector);
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+    virtual void visitChildren(Visitor& visitor) const;
+
+private:
+    // Vectors are read in and evaluated as flat arrays. Appending to a
+    // vector with more than a trie node's worth of items builds a trie,
+    // which is then kept for further appends.
+    const PersistentVector& trie() const;
+
+    mutable PersistentVector m_trie;
+    mutable bool             m_hasTrie;
 };
 
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    TAGS(BUILTIN, LAMBDA);
+
+    malApplicable(Tag tag) : malValue(tag) { }
+    malApplicable(Tag tag, malValuePtr meta) : malValue(tag, meta) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd,
-                               malEnvPtr env) const = 0;
+                               malEnvRef env) const = 0;
 };
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    TAGS(HASH, HASH);
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
+    malHash(const PersistentMap& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(HASH, meta), m_map(that.m_map)
+    , m_isEvaluated(that.m_isEvaluated) { traceMap(); }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
-    malValuePtr get(malValuePtr key) const;
+    bool contains(malValueRef key) const;
+    malValuePtr eval(malEnvRef env);
+    malValuePtr get(malValueRef key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
 
+    // False for a literal read in, whose values eval evaluates.
+    bool isEvaluated() const { return m_isEvaluated; }
+
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    virtual void visitChildren(Visitor& visitor) const {
+        malValue::visitChildren(visitor);
+        m_map.visitNodes(visitor);
+    }
+
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    void traceMap() const;
+
+    const PersistentMap m_map;
     const bool m_isEvaluated;
 };
 
@@ -264,17 +736,28 @@ public:
     typedef malValuePtr (ApplyFunc)(const String& name,
                                     malValueIter argsBegin,
                                     malValueIter argsEnd,
-                                    malEnvPtr env);
+                                    malEnvRef env);
+
+    // Builtins which take one or two arguments can also have handlers
+    // which take them directly, so that EVAL can call them without
+    // putting the arguments on the stack or checking how many there are.
+    typedef malValuePtr (UnaryFunc)(malValueRef arg);
+    typedef malValuePtr (BinaryFunc)(malValueRef lhs, malValueRef rhs);
+
+    TAGS(BUILTIN, BUILTIN);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    malBuiltIn(const String& name, ApplyFunc* handler,
+               UnaryFunc* unary = NULL, BinaryFunc* binary = NULL)
+    : malApplicable(BUILTIN), m_name(name), m_handler(handler)
+    , m_unary(unary), m_binary(binary) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(BUILTIN, meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_unary(that.m_unary), m_binary(that.m_binary) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd,
-                              malEnvPtr env) const;
+                              malEnvRef env) const;
 
     virtual String print(bool readably) const {
         return STRF("#builtin-function(%s)", m_name.c_str());
@@ -286,24 +769,35 @@ public:
 
     String name() const { return m_name; }
 
+    UnaryFunc*  unary()  const { return m_unary; }
+    BinaryFunc* binary() const { return m_binary; }
+
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    UnaryFunc* m_unary;
+    BinaryFunc* m_binary;
 };
 
 class malLambda : public malApplicable {
 public:
+    TAGS(LAMBDA, LAMBDA);
+
     malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malSymbolVec& bindings, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd,
-                              malEnvPtr env) const;
+                              malEnvRef env) const;
 
+    const malSymbolVec& getBindings() const { return m_bindings; }
     malValuePtr getBody() const { return m_body; }
+    // The analyser replaces a body which has gone out of date.
+    void setBody(malValuePtr body) const { m_body = body; }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -318,18 +812,22 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void visitChildren(Visitor& visitor) const;
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
-    const bool        m_isMacro;
+    const malSymbolVec  m_bindings;
+    mutable malValuePtr m_body;
+    const malEnvPtr     m_env;
+    const bool          m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    TAGS(ATOM, ATOM);
+
+    malAtom(malValuePtr value) : malValue(ATOM), m_value(value) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(ATOM, meta), m_value(that.m_value) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
@@ -343,6 +841,13 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void visitChildren(Visitor& visitor) const {
+        malValue::visitChildren(visitor);
+        visitor.visit(m_value);
+    }
+
+    virtual void dropReferences() { m_value = malValuePtr(); }
+
     WITH_META(malAtom);
 
 private:
@@ -350,22 +855,26 @@ private:
 };
 
 namespace mal {
+    malValuePtr analysedList(malValueVec* items, malValuePtr source);
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
     malValuePtr falseValue();
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
-    malValuePtr integer(int value);
+    malValuePtr hash(const PersistentMap& map);
+    malValuePtr integer(int64_t value);
+    malValuePtr integer(const BigInt& value);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malSymbolVec&, malValuePtr, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
+    malValuePtr local(malSymbol* symbol, int depth, int slot);
     malValuePtr macro(const malLambda& lambda);
     malValuePtr nilValue();
     malValuePtr string(const String& token);
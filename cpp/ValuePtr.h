@@ -0,0 +1,119 @@
+#ifndef INCLUDE_VALUEPTR_H
+#define INCLUDE_VALUEPTR_H
+
+#include "RefCountedPtr.h"
+
+#include <stdint.h>
+
+class malValue;
+class malValueBox;
+
+// A malValuePtr either points to a refcounted malValue, or holds an integer
+// directly. Objects are at least 2-byte aligned, so the low bit is free to
+// tag an integer, which is stored shifted up by one. Integers made this way
+// need no allocation and no refcounting.
+//
+// ptr() returns NULL for an integer, so DYNAMIC_CAST fails for every type.
+// Use isInteger() and integerValue() (or toInteger() in Types.h) instead.
+// operator-> boxes an integer in a temporary malInteger, so the virtual
+// methods still work on it.
+template<>
+class RefCountedPtr<malValue> {
+public:
+    RefCountedPtr() : m_bits(0) { }
+
+    RefCountedPtr(malValue* object);
+
+    RefCountedPtr(const RefCountedPtr& rhs) : m_bits(rhs.m_bits)
+    { acquire(); }
+
+    RefCountedPtr(RefCountedPtr&& rhs) : m_bits(rhs.m_bits)
+    { rhs.m_bits = 0; }
+
+    // In both assignments rhs may be owned by our current object, so it's
+    // read and acquired before that is released.
+    const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
+        uintptr_t bits = rhs.m_bits;
+        rhs.acquire();
+        release();
+        m_bits = bits;
+        return *this;
+    }
+
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) {
+        uintptr_t bits = rhs.m_bits;
+        rhs.m_bits = 0;
+        release();
+        m_bits = bits;
+        return *this;
+    }
+
+    bool operator == (const RefCountedPtr& rhs) const {
+        return m_bits == rhs.m_bits;
+    }
+
+    bool operator != (const RefCountedPtr& rhs) const {
+        return m_bits != rhs.m_bits;
+    }
+
+    operator bool () const {
+        return m_bits != 0;
+    }
+
+    ~RefCountedPtr() {
+        release();
+    }
+
+    malValueBox operator -> () const;
+    malValue* ptr() const;
+
+    static bool canHoldInteger(int64_t value) {
+        return static_cast<intptr_t>(static_cast<uintptr_t>(value) << 1) >> 1
+            == value;
+    }
+
+    static RefCountedPtr fromInteger(int64_t value) {
+        RefCountedPtr result;
+        result.m_bits = (static_cast<uintptr_t>(value) << 1) | 1;
+        return result;
+    }
+
+    bool isInteger() const { return (m_bits & 1) != 0; }
+
+    // Whether both hold integers, in one test.
+    static bool areIntegers(const RefCountedPtr& lhs, const RefCountedPtr& rhs) {
+        return (lhs.m_bits & rhs.m_bits & 1) != 0;
+    }
+
+    int64_t integerValue() const {
+        return static_cast<intptr_t>(m_bits) >> 1;
+    }
+
+private:
+    bool isObject() const { return (m_bits != 0) && !isInteger(); }
+
+    const RefCounted* object() const {
+        return reinterpret_cast<const RefCounted*>(m_bits);
+    }
+
+    void acquire() const {
+        if (isObject()) {
+            object()->acquire();
+        }
+    }
+
+    void release() {
+        if (isObject()) {
+            if (object()->release() == 0) {
+                RefCounted::destroy(object());
+            }
+            else {
+                object()->released();
+            }
+        }
+    }
+
+    uintptr_t m_bits;
+};
+
+#endif // INCLUDE_VALUEPTR_H
@@ -55,12 +55,12 @@ String PRINT(malValuePtr ast)
 }
 
 // These have been added after step 1 to keep the linker happy.
-malValuePtr EVAL(malValuePtr ast, malEnvPtr)
+malValuePtr EVAL(malValueRef ast, malEnvRef)
 {
     return ast;
 }
 
-malValuePtr APPLY(malValuePtr ast, malValueIter, malValueIter, malEnvPtr)
+malValuePtr APPLY(malValueRef ast, malValueIter, malValueIter, malEnvRef)
 {
     return ast;
 }
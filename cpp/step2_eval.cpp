@@ -49,8 +49,10 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+malValuePtr EVAL(malValueRef ast, malEnvRef env)
 {
+    RefCounted::collectCyclesIfDue();
+
     return ast->eval(env);
 }
 
@@ -59,8 +61,8 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
-                  malEnvPtr env)
+malValuePtr APPLY(malValueRef op, malValueIter argsBegin, malValueIter argsEnd,
+                  malEnvRef env)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -69,8 +71,6 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
     return handler->apply(argsBegin, argsEnd, env);
 }
 
-#define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
-
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, std::distance(argsBegin, argsEnd))
 
@@ -78,42 +78,57 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
     checkArgsBetween(name.c_str(), min, max, std::distance(argsBegin, argsEnd))
 
 
+// As in Core.cpp, arithmetic is done on int64_t when both arguments fit and
+// the result does, and redone with bignums if not.
+#define INTOP(op, overflows) \
+    int64_t lhs, rhs, result; \
+    if (isInt64(argsBegin[0], lhs) && isInt64(argsBegin[1], rhs) && \
+            !overflows(lhs, rhs, &result)) { \
+        return mal::integer(result); \
+    } \
+    return mal::integer(toBigInt(argsBegin[0]) op toBigInt(argsBegin[1]))
+
 static malValuePtr builtIn_add(const String& name,
-    malValueIter argsBegin, malValueIter argsEnd, malEnvPtr env)
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() + rhs->value());
+        INTOP(+, __builtin_add_overflow);
 }
 
 static malValuePtr builtIn_sub(const String& name,
-    malValueIter argsBegin, malValueIter argsEnd, malEnvPtr env)
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
 {
         int argCount = CHECK_ARGS_BETWEEN(1, 2);
-        ARG(malInteger, lhs);
         if (argCount == 1) {
-            return mal::integer(- lhs->value());
+            int64_t value;
+            if (isInt64(argsBegin[0], value) && (value != INT64_MIN)) {
+                return mal::integer(- value);
+            }
+            return mal::integer(- toBigInt(argsBegin[0]));
         }
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() - rhs->value());
+        INTOP(-, __builtin_sub_overflow);
 }
 
 static malValuePtr builtIn_mul(const String& name,
-    malValueIter argsBegin, malValueIter argsEnd, malEnvPtr env)
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        return mal::integer(lhs->value() * rhs->value());
+        INTOP(*, __builtin_mul_overflow);
+}
+
+static bool divOverflows(int64_t lhs, int64_t rhs, int64_t* result)
+{
+    MAL_CHECK(rhs != 0, "Division by zero");
+    if ((lhs == INT64_MIN) && (rhs == -1)) {
+        return true;
+    }
+    *result = lhs / rhs;
+    return false;
 }
 
 static malValuePtr builtIn_div(const String& name,
-    malValueIter argsBegin, malValueIter argsEnd, malEnvPtr env)
+    malValueIter argsBegin, malValueIter argsEnd, malEnvRef env)
 {
         CHECK_ARGS_IS(2);
-        ARG(malInteger, lhs);
-        ARG(malInteger, rhs);
-        MAL_CHECK(rhs->value() != 0, "Division by zero"); \
-        return mal::integer(lhs->value() / rhs->value());
+        INTOP(/, divOverflows);
 }
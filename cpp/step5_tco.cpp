@@ -46,9 +46,13 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+malValuePtr EVAL(malValueRef astIn, malEnvRef envIn)
 {
+    malValuePtr ast = astIn;
+    malEnvPtr env = envIn;
     while (1) {
+        RefCounted::collectCyclesIfDue();
+
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -138,8 +142,8 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
-                  malEnvPtr env)
+malValuePtr APPLY(malValueRef op, malValueIter argsBegin, malValueIter argsEnd,
+                  malEnvRef env)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
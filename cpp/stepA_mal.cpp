@@ -1,9 +1,12 @@
 #include "MAL.h"
 
+#include "ArgStack.h"
+#include "Bytecode.h"
 #include "Environment.h"
 #include "ReadLine.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <iostream>
 #include <memory>
 
@@ -14,13 +17,26 @@ static void installFunctions(malEnvPtr env);
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static void safeRep(const String& input, malEnvPtr env);
 static malValuePtr quasiquote(malValuePtr obj);
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static malValuePtr analyseLambda(const malSymbolVec& params, malValuePtr body,
+                                 malEnvPtr env);
 static void installMacros(malEnvPtr env);
+static malValuePtr currentBody(const malLambda* lambda, malEnvRef env);
+static malValuePtr evalCompiled(malValuePtr ast, malEnvPtr env);
 
 static ReadLine s_readLine("~/.mal-history");
 
+// Set by --vm, to compile each form to bytecode and run that, rather than
+// evaluating it with EVAL.
+static bool s_compile = false;
+
 int main(int argc, char* argv[])
 {
+    if ((argc > 1) && (String(argv[1]) == "--vm")) {
+        s_compile = true;
+        argc--;
+        argv++;
+    }
+
     String prompt = "user> ";
     String input;
     malEnvPtr replEnv(new malEnv);
@@ -73,161 +89,222 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
-malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+malValuePtr EVAL(malValueRef astIn, malEnvRef envIn)
 {
+    // Atoms evaluate without touching the caller's references; only a list
+    // needs local copies, because TCO rebinds ast and env below.
+    if (astIn.isInteger()) {
+        return astIn;
+    }
+    if (astIn->tag() != malValue::LIST &&
+        astIn->tag() != malValue::ANALYSED_LIST) {
+        return astIn->eval(envIn);
+    }
+    if (s_compile) {
+        return evalCompiled(astIn, envIn);
+    }
+
+    malValuePtr ast = astIn;
+    malEnvPtr env = envIn;
     while (1) {
+        RefCounted::collectCyclesIfDue();
+
+        if (ast.isInteger()) {
+            return ast;
+        }
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
         }
 
-        ast = macroExpand(ast, env);
-        list = DYNAMIC_CAST(malList, ast);
-        if (!list || (list->count() == 0)) {
-            return ast->eval(env);
+        // The analyser has expanded the macro calls in an analysed list
+        // already, unless the macros have changed since. Its operator can
+        // still be a local holding a macro.
+        const malAnalysedList* analysed = DYNAMIC_CAST(malAnalysedList, ast);
+        if (analysed && !analysed->isCurrent()) {
+            ast = analysed->source();
+            analysed = NULL;
+        }
+        if (!analysed || DYNAMIC_CAST(malLocal, list->item(0))) {
+            ast = macroExpand(ast, env);
+            list = DYNAMIC_CAST(malList, ast);
+            if (!list || (list->count() == 0)) {
+                return ast->eval(env);
+            }
         }
 
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
+            switch (symbol->special()) {
+                case malSymbol::DEF: {
+                    checkArgsIs("def!", 2, argCount);
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    return define(id, EVAL(list->item(2), env), env);
+                }
 
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
+                case malSymbol::DEFMACRO: {
+                    checkArgsIs("defmacro!", 2, argCount);
 
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
-            }
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    malValuePtr body = EVAL(list->item(2), env);
+                    const malLambda* lambda = VALUE_CAST(malLambda, body);
+                    return define(id, mal::macro(*lambda), env);
+                }
 
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
+                case malSymbol::DO: {
+                    checkArgsAtLeast("do", 1, argCount);
 
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
+                    for (int i = 1; i < argCount; i++) {
+                        EVAL(list->item(i), env);
+                    }
+                    ast = list->item(argCount);
+                    continue; // TCO
                 }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+                case malSymbol::FN: {
+                    checkArgsIs("fn*", 2, argCount);
+
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    malSymbolVec params;
+                    for (int i = 0; i < bindings->count(); i++) {
+                        const malSymbol* sym =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        params.push_back(sym->interned());
+                    }
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    // The bodies of nested fn* forms are analysed along
+                    // with the outermost one.
+                    malValuePtr body = list->item(2);
+                    if (!DYNAMIC_CAST(malAnalysedList, ast)) {
+                        body = analyseLambda(params, body, env);
+                    }
+                    return mal::lambda(params, body, env);
                 }
 
-                return mal::lambda(params, list->item(2), env);
-            }
+                case malSymbol::IF: {
+                    checkArgsBetween("if", 2, 3, argCount);
 
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+                    bool isTrue = EVAL(list->item(1), env)->isTrue();
+                    if (!isTrue && (argCount == 2)) {
+                        return mal::nilValue();
+                    }
+                    ast = list->item(isTrue ? 2 : 3);
+                    continue; // TCO
+                }
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
+                case malSymbol::LET: {
+                    checkArgsIs("let*", 2, argCount);
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    int count = checkArgsEven("let*", bindings->count());
+                    malEnvPtr inner(new malEnv(env));
+                    for (int i = 0; i < count; i += 2) {
+                        const malSymbol* var =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        inner->set(var, EVAL(bindings->item(i+1), inner));
+                    }
+                    ast = list->item(2);
+                    env = inner;
+                    continue; // TCO
                 }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
-            }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                case malSymbol::MACROEXPAND: {
+                    checkArgsIs("macroexpand", 1, argCount);
+                    return macroExpand(list->item(1), env);
                 }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
-            }
 
-            if (special == "macroexpand") {
-                checkArgsIs("macroexpand", 1, argCount);
-                return macroExpand(list->item(1), env);
-            }
+                case malSymbol::QUASIQUOTE: {
+                    checkArgsIs("quasiquote", 1, argCount);
+                    ast = quasiquote(list->item(1));
+                    continue; // TCO
+                }
 
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
-            }
+                case malSymbol::QUOTE: {
+                    checkArgsIs("quote", 1, argCount);
+                    return list->item(1);
+                }
 
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
+                case malSymbol::TRY: {
+                    checkArgsIs("try*", 2, argCount);
+                    malValuePtr tryBody = list->item(1);
+                    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
 
-            if (special == "try*") {
-                checkArgsIs("try*", 2, argCount);
-                malValuePtr tryBody = list->item(1);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+                    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+                    MAL_CHECK(VALUE_CAST(malSymbol,
+                        catchBlock->item(0))->special() == malSymbol::CATCH,
+                        "catch block must begin with catch*");
 
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
+                    // We don't need excSym at this scope, but we want to check
+                    // that the catch block is valid always, not just in case of
+                    // an exception.
+                    const malSymbol* excSym =
+                        VALUE_CAST(malSymbol, catchBlock->item(1));
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+                    malValuePtr excVal;
 
-                malValuePtr excVal;
+                    try {
+                        ast = EVAL(tryBody, env);
+                    }
+                    catch(String& s) {
+                        excVal = mal::string(s);
+                    }
+                    catch (malEmptyInputException&) {
+                        // Not an error, continue as if we got nil
+                        ast = mal::nilValue();
+                    }
+                    catch(malValuePtr& o) {
+                        excVal = o;
+                    };
 
-                try {
-                    ast = EVAL(tryBody, env);
+                    if (excVal) {
+                        // we got some exception
+                        env = malEnvPtr(new malEnv(env));
+                        env->set(excSym, excVal);
+                        ast = catchBlock->item(2);
+                    }
+                    continue; // TCO
                 }
-                catch(String& s) {
-                    excVal = mal::string(s);
-                }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
-                }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
-                continue; // TCO
+
+                default:
+                    break;
             }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
-        std::unique_ptr<malValueVec> items(list->evalItems(env));
-        malValuePtr op = items->at(0);
+        // A builtin with a handler for this many arguments is passed them
+        // directly. Otherwise the arguments are evaluated onto the argument
+        // stack, after the operator.
+        malValueIter it = list->begin(), end = list->end();
+        int count = end - it;
+        malValuePtr opValue = EVAL(*it++, env);
+        if (count <= 3) {
+            if (const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, opValue)) {
+                if ((count == 2) && builtIn->unary()) {
+                    return builtIn->unary()(EVAL(it[0], env));
+                }
+                if ((count == 3) && builtIn->binary()) {
+                    malValuePtr lhs = EVAL(it[0], env);
+                    return builtIn->binary()(lhs, EVAL(it[1], env));
+                }
+            }
+        }
+        malArgStack::Frame items(count);
+        items[0] = std::move(opValue);
+        for (malValueIter arg = items.begin() + 1; it != end; ++it) {
+            *arg++ = EVAL(*it, env);
+        }
+        malValueRef op = items[0];
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items.begin()+1, items.end());
+            ast = currentBody(lambda, env);
             continue; // TCO
         }
         else {
-            return APPLY(op, items->begin()+1, items->end(), env);
+            return APPLY(op, items.begin()+1, items.end(), env);
         }
     }
 }
@@ -237,8 +314,8 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
-                  malEnvPtr env)
+malValuePtr APPLY(malValueRef op, malValueIter argsBegin, malValueIter argsEnd,
+                  malEnvRef env)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
     MAL_CHECK(handler != NULL,
@@ -247,10 +324,10 @@ malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd,
     return handler->apply(argsBegin, argsEnd, env);
 }
 
-static bool isSymbol(malValuePtr obj, const String& text)
+static bool isSymbol(malValuePtr obj, malSymbol::Special special)
 {
     const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
+    return sym && (sym->special() == special);
 }
 
 static const malSequence* isPair(malValuePtr obj)
@@ -266,57 +343,895 @@ static malValuePtr quasiquote(malValuePtr obj)
         return mal::list(mal::symbol("quote"), obj);
     }
 
-    if (isSymbol(seq->item(0), "unquote")) {
+    if (isSymbol(seq->item(0), malSymbol::UNQUOTE)) {
         // (qq (uq form)) -> form
         checkArgsIs("unquote", 1, seq->count() - 1);
         return seq->item(1);
     }
 
-    const malSequence* innerSeq = isPair(seq->item(0));
-    if (innerSeq && isSymbol(innerSeq->item(0), "splice-unquote")) {
-        checkArgsIs("splice-unquote", 1, innerSeq->count() - 1);
-        // (qq (sq '(a b c))) -> a b c
-        return mal::list(
-            mal::symbol("concat"),
-            innerSeq->item(1),
-            quasiquote(seq->rest())
-        );
+    // (qq (a (uq b) (sq c) (d))) -> a template for (a b c... (qq (d)))
+    malTemplate* tmpl = new malTemplate;
+    malValuePtr result(tmpl);
+    bool isConstant = true;
+    int count = seq->count();
+    for (int i = 0; i < count; i++) {
+        malValuePtr item = seq->item(i);
+        if (isSymbol(item, malSymbol::UNQUOTE)) {
+            // (qq (a uq b)) -> (cons a b)
+            checkArgsIs("unquote", 1, count - i - 1);
+            tmpl->add(malTemplate::SPLICED, seq->item(i + 1));
+            isConstant = false;
+            break;
+        }
+        const malSequence* innerSeq = isPair(item);
+        if (!innerSeq) {
+            tmpl->add(malTemplate::QUOTED, item);
+        }
+        else if (isSymbol(innerSeq->item(0), malSymbol::SPLICE_UNQUOTE)) {
+            checkArgsIs("splice-unquote", 1, innerSeq->count() - 1);
+            tmpl->add(malTemplate::SPLICED, innerSeq->item(1));
+            isConstant = false;
+        }
+        else {
+            malValuePtr form = quasiquote(item);
+            const malList* quoted = DYNAMIC_CAST(malList, form);
+            if (quoted && (quoted->count() == 2) &&
+                    isSymbol(quoted->item(0), malSymbol::QUOTE)) {
+                tmpl->add(malTemplate::QUOTED, quoted->item(1));
+            }
+            else {
+                tmpl->add(malTemplate::UNQUOTED, form);
+                isConstant = false;
+            }
+        }
     }
-    else {
-        // (qq (a b c)) -> (list (qq a) (qq b) (qq c))
-        // (qq xs     ) -> (cons (qq (car xs)) (qq (cdr xs)))
-        return mal::list(
-            mal::symbol("cons"),
-            quasiquote(seq->first()),
-            quasiquote(seq->rest())
-        );
+
+    if (isConstant) {
+        malValueVec* items = new malValueVec;
+        items->reserve(count);
+        for (int i = 0; i < count; i++) {
+            items->push_back(tmpl->form(i));
+        }
+        return mal::list(mal::symbol("quote"), mal::list(items));
     }
+    return result;
+}
+
+static bool isMacro(malValuePtr value)
+{
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    return lambda && lambda->isMacro();
 }
 
 static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
 {
     if (const malSequence* seq = isPair(obj)) {
+        malValuePtr value;
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->first())) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            if (malEnvPtr symEnv = env->find(sym)) {
+                value = sym->eval(symEnv);
             }
         }
+        else if (DYNAMIC_CAST(malLocal, seq->first())) {
+            value = seq->first()->eval(env);
+        }
+        if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+            return lambda->isMacro() ? lambda : NULL;
+        }
     }
     return NULL;
 }
 
-static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
+        // Macros are given the code as it was written, not as analysed.
+        if (const malAnalysedList* analysed =
+                DYNAMIC_CAST(malAnalysedList, obj)) {
+            obj = analysed->source();
+        }
         const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end(), env);
+        malEnvPtr frame = macro->makeEnv(seq->begin() + 1, seq->end());
+        obj = EVAL(currentBody(macro, frame), frame);
     }
     return obj;
 }
 
+// Macros are expanded as code is analysed or compiled, so defining a macro,
+// or redefining or hiding one, puts the code made so far out of date.
+malValuePtr define(const malSymbol* id, malValuePtr value, malEnvPtr env)
+{
+    bool changesMacro = isMacro(value);
+    if (!changesMacro) {
+        if (malEnvPtr idEnv = env->find(id)) {
+            changesMacro = isMacro(idEnv->get(id));
+        }
+    }
+    if (changesMacro) {
+        malAnalysedList::macrosChanged();
+    }
+    return env->set(id, value);
+}
+
+// The analyser rewrites the body of a fn* when the closure is created, so
+// that each reference to a local bound within the fn* becomes a malLocal,
+// which reads the value straight out of a frame slot. Everything else is
+// left for EVAL to look up by name, as before:
+//  - free variables of the outermost fn*,
+//  - quoted code,
+//  - the whole body, if it uses def! or defmacro!, as these can add
+//    bindings to a local frame at run time and so move the slots around.
+//
+// Macro calls are expanded as they are analysed, rather than each time
+// they are evaluated. When the macros change, the closures made before
+// then are analysed again on their next call.
+
+class Scope {
+public:
+    // The compiler makes a dynamic scope for a frame which def! can add to.
+    // Nothing in it gets a slot, and names which aren't bound in it are
+    // looked up by name from its frame.
+    Scope(const Scope* outer, bool dynamic = false)
+    : m_outer(outer), m_dynamic(dynamic) { }
+
+    void bind(const malSymbol* symbol) {
+        if (slot(symbol) < 0) {
+            m_names.push_back(symbol->interned());
+        }
+    }
+
+    // Names which will be bound in this frame later on. Any reference to
+    // them before then has to be looked up by name, from this frame.
+    void declare(const malSymbol* symbol) {
+        m_pending.push_back(symbol->interned());
+    }
+
+    malValuePtr resolve(malSymbol* symbol) const {
+        int depth, slot;
+        find(this, symbol, depth, slot);
+        return mal::local(symbol, depth, slot);
+    }
+
+    // Sets the depth of the frame to look for a symbol in, and its slot
+    // there, or -1 if it must be looked up by name from that frame.
+    static void find(const Scope* scope, const malSymbol* symbol,
+                     int& depth, int& slot) {
+        depth = 0;
+        slot  = -1;
+        for (; scope; scope = scope->m_outer) {
+            if (scope->m_dynamic) {
+                return;
+            }
+            slot = scope->slot(symbol);
+            if ((slot >= 0) || scope->isPending(symbol)) {
+                return;
+            }
+            depth++;
+        }
+    }
+
+    // Whether any scope out from this one binds the symbol.
+    static bool binds(const Scope* scope, const malSymbol* symbol) {
+        for (; scope; scope = scope->m_outer) {
+            if ((scope->slot(symbol) >= 0) || scope->isPending(symbol)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    int slot(const malSymbol* symbol) const {
+        auto it = std::find(m_names.begin(), m_names.end(),
+                            symbol->interned());
+        return it == m_names.end() ? -1 : it - m_names.begin();
+    }
+
+    bool isPending(const malSymbol* symbol) const {
+        return std::find(m_pending.begin(), m_pending.end(),
+                         symbol->interned()) != m_pending.end();
+    }
+
+    malSymbolVec m_names;
+    malSymbolVec m_pending;
+    const Scope* m_outer;
+    const bool   m_dynamic;
+};
+
+static malValuePtr analyse(malValuePtr ast, const Scope* scope,
+                           malEnvPtr env);
+static malValuePtr analyseExpansion(malValuePtr ast, const Scope* scope,
+                                    malEnvPtr env);
+
+static bool definesAnything(malValuePtr ast)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        return (sym->special() == malSymbol::DEF) ||
+               (sym->special() == malSymbol::DEFMACRO);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        return definesAnything(hash->values());
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, ast)) {
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            if (definesAnything(*it)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool bindsSymbols(const malSequence* seq, int step)
+{
+    for (int i = 0; i < seq->count(); i += step) {
+        if (!DYNAMIC_CAST(malSymbol, seq->item(i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static malValueVec* analyseItems(const malSequence* seq, int start,
+                                 const Scope* scope, malEnvPtr env)
+{
+    malValueVec* items = new malValueVec;
+    items->reserve(seq->count());
+    for (int i = 0; i < start; i++) {
+        items->push_back(seq->item(i));
+    }
+    for (auto it = seq->begin() + start, end = seq->end(); it != end; ++it) {
+        items->push_back(analyse(*it, scope, env));
+    }
+    return items;
+}
+
+static malValuePtr analyseBody(const malSequence* params, malValuePtr body,
+                               const Scope* outer, malEnvPtr env)
+{
+    Scope scope(outer);
+    for (auto it = params->begin(), end = params->end(); it != end; ++it) {
+        const malSymbol* param = STATIC_CAST(malSymbol, *it);
+        if (param->value() != "&") {
+            scope.bind(param);
+        }
+    }
+    return analyse(body, &scope, env);
+}
+
+static malValuePtr analyseSpecial(malValuePtr ast, const Scope* scope,
+                                  malEnvPtr env)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const malSymbol* special = STATIC_CAST(malSymbol, list->item(0));
+    int argCount = list->count() - 1;
+
+    // Malformed special forms are left for EVAL to report.
+    switch (special->special()) {
+        case malSymbol::FN: {
+            const malSequence* params =
+                DYNAMIC_CAST(malSequence, list->item(1));
+            if ((argCount != 2) || !params || !bindsSymbols(params, 1)) {
+                break;
+            }
+            malValuePtr body = analyseBody(params, list->item(2), scope, env);
+            return mal::analysedList(new malValueVec {
+                list->item(0), list->item(1), body }, ast);
+        }
+
+        case malSymbol::LET: {
+            const malSequence* bindings =
+                DYNAMIC_CAST(malSequence, list->item(1));
+            if ((argCount != 2) || !bindings || (bindings->count() % 2 != 0)
+                                || !bindsSymbols(bindings, 2)) {
+                break;
+            }
+            // Each binding is evaluated in the new frame, and can see the
+            // ones bound before it.
+            Scope inner(scope);
+            for (int i = 0; i < bindings->count(); i += 2) {
+                inner.declare(STATIC_CAST(malSymbol, bindings->item(i)));
+            }
+            malValueVec* items = new malValueVec;
+            for (int i = 0; i < bindings->count(); i += 2) {
+                malValuePtr var = bindings->item(i);
+                items->push_back(var);
+                items->push_back(analyse(bindings->item(i+1), &inner, env));
+                inner.bind(STATIC_CAST(malSymbol, var));
+            }
+            malValuePtr body = analyse(list->item(2), &inner, env);
+            return mal::analysedList(new malValueVec {
+                list->item(0), mal::list(items), body }, ast);
+        }
+
+        case malSymbol::TRY: {
+            const malList* catchBlock = DYNAMIC_CAST(malList, list->item(2));
+            if ((argCount != 2) || !catchBlock || (catchBlock->count() != 3)
+                                || !bindsSymbols(catchBlock, 1)) {
+                break;
+            }
+            malValuePtr tryBody = analyse(list->item(1), scope, env);
+            Scope inner(scope);
+            inner.bind(STATIC_CAST(malSymbol, catchBlock->item(1)));
+            malValuePtr catchBody = analyse(catchBlock->item(2), &inner, env);
+            return mal::analysedList(new malValueVec {
+                list->item(0), tryBody, mal::list(catchBlock->item(0),
+                    catchBlock->item(1), catchBody) }, ast);
+        }
+
+        case malSymbol::DO:
+        case malSymbol::IF:
+            return mal::analysedList(analyseItems(list, 1, scope, env), ast);
+
+        case malSymbol::QUASIQUOTE: {
+            if (argCount != 1) {
+                break;
+            }
+            malValuePtr form;
+            try {
+                form = quasiquote(list->item(1));
+            }
+            catch (String&) {
+                break;
+            }
+            return analyse(form, scope, env);
+        }
+
+        default:
+            break;
+    }
+    return ast;
+}
+
+static malValuePtr analyse(malValuePtr ast, const Scope* scope,
+                           malEnvPtr env)
+{
+    if (malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        return scope->resolve(sym);
+    }
+    if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        return mal::vector(analyseItems(vec, 0, scope, env));
+    }
+    if (const malTemplate* tmpl = DYNAMIC_CAST(malTemplate, ast)) {
+        malTemplate* analysed = new malTemplate;
+        malValuePtr result(analysed);
+        for (int i = 0; i < tmpl->count(); i++) {
+            malValuePtr form = tmpl->form(i);
+            if (tmpl->kind(i) != malTemplate::QUOTED) {
+                form = analyse(form, scope, env);
+            }
+            analysed->add(tmpl->kind(i), form);
+        }
+        return result;
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return ast;
+    }
+
+    // EVAL treats the special forms as such even if the name is bound.
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if (sym->special() != malSymbol::NONE) {
+            return analyseSpecial(ast, scope, env);
+        }
+        // A local might hold a macro, but there's no knowing until the
+        // code runs.
+        if (!Scope::binds(scope, sym) && isMacroApplication(ast, env)) {
+            return analyseExpansion(ast, scope, env);
+        }
+    }
+    return mal::analysedList(analyseItems(list, 0, scope, env), ast);
+}
+
+// The expansion keeps the macro call as its source, to go back to if the
+// macros change. A macro which throws, or whose expansion defines things,
+// is left for EVAL to expand if the call is reached, as is one which keeps
+// expanding into further macro calls.
+static malValuePtr analyseExpansion(malValuePtr ast, const Scope* scope,
+                                    malEnvPtr env)
+{
+    static const int maxDepth = 64;
+    static int depth = 0;
+    if (depth >= maxDepth) {
+        return ast;
+    }
+
+    malValuePtr expansion;
+    try {
+        expansion = macroExpand(ast, env);
+    }
+    catch (String&) {
+        return ast;
+    }
+    catch (malValuePtr&) {
+        return ast;
+    }
+    if (definesAnything(expansion)) {
+        return ast;
+    }
+
+    depth++;
+    malValuePtr analysed = analyse(expansion, scope, env);
+    depth--;
+    if (const malAnalysedList* list = DYNAMIC_CAST(malAnalysedList, analysed)) {
+        return mal::analysedList(
+            new malValueVec(list->begin(), list->end()), ast);
+    }
+    return mal::analysedList(
+        new malValueVec { mal::symbol("do"), analysed }, ast);
+}
+
+static malValuePtr analyseLambda(const malSymbolVec& params, malValuePtr body,
+                                 malEnvPtr env)
+{
+    if (definesAnything(body)) {
+        return body;
+    }
+    Scope scope(NULL);
+    for (auto it = params.begin(), end = params.end(); it != end; ++it) {
+        if ((*it)->value() != "&") {
+            scope.bind(*it);
+        }
+    }
+    return analyse(body, &scope, env);
+}
+
+// Gives the body of a closure as analysed with the macros as they are now.
+// The call's frame stands in for the closure's environment, as the
+// parameters are all it adds.
+static malValuePtr currentBody(const malLambda* lambda, malEnvRef env)
+{
+    malValuePtr body = lambda->getBody();
+    const malAnalysedList* analysed = DYNAMIC_CAST(malAnalysedList, body);
+    if (analysed && !analysed->isCurrent()) {
+        body = analyseLambda(lambda->getBindings(), analysed->source(), env);
+        lambda->setBody(body);
+    }
+    return body;
+}
+
+// The compiler does the analyser's work, then lowers the code to bytecode
+// for malCode to run. Macros are expanded as the code is compiled, rather
+// than each time it runs, and each fn* is compiled along with the code it's
+// in. A call whose operator is defined as a macro later on is expanded
+// when the call is reached instead. A fn* body compiled before the macros
+// changed is compiled again when it's next called.
+
+class Compiler {
+public:
+    // Compiles the code for a form evaluated in env.
+    static malValuePtr compile(malValuePtr ast, malEnvPtr env);
+
+    // Compiles a closure's body for a call whose frame is env.
+    static malValuePtr compileBody(const malSymbolVec& params,
+                                   malValuePtr body, malEnvPtr env);
+
+private:
+    Compiler(malCode* code, const Scope* scope, bool dynamic, malEnvPtr env)
+    : m_code(code), m_scope(scope), m_dynamic(dynamic), m_top(1), m_env(env)
+    { }
+
+    // Each of these compiles code which leaves the value of the form in
+    // register dst, or returns it if tail is set. Registers from m_top up
+    // are free for temporaries.
+    void compile(malValuePtr ast, int dst, bool tail);
+    void compileList(malValuePtr ast, int dst, bool tail);
+    void compileForm(malValuePtr ast, int dst, bool tail);
+    bool compileSpecial(const malList* list, int dst, bool tail);
+    void compileCall(const malList* list, malValuePtr ast, int dst, bool tail);
+    void compileItems(const malSequence* seq, malCode::Op op, int dst);
+    void compileHash(const malHash* hash, int dst);
+    void compileTemplate(const malTemplate* tmpl, int dst);
+    void compileSymbol(const malSymbol* symbol, int dst);
+    malValuePtr compileLambda(const malSymbolVec& params, malValuePtr body);
+
+    int emit(malCode::Op op, int a = 0, int b = 0, int c = 0) {
+        return m_code->emit(op, a, b, c);
+    }
+    void emitResult(int dst, bool tail) {
+        if (tail) {
+            emit(malCode::RETURN, dst);
+        }
+    }
+    // Makes the jump at index go to the next instruction.
+    void patch(int index) {
+        m_code->instruction(index).b = m_code->here();
+    }
+    int allocate(int count) {
+        int first = m_top;
+        m_top += count;
+        m_code->useRegisters(m_top);
+        return first;
+    }
+
+    malCode* const  m_code;
+    const Scope*    m_scope;
+    const bool      m_dynamic;  // the code can def! into its own frame
+    int             m_top;
+    const malEnvPtr m_env;
+};
+
+malValuePtr Compiler::compile(malValuePtr ast, malEnvPtr env)
+{
+    malValuePtr code(new malCode(malSymbolVec()));
+    Compiler compiler(STATIC_CAST(malCode, code), NULL,
+                      definesAnything(ast), env);
+    compiler.compile(ast, 0, true);
+    STATIC_CAST(malCode, code)->finish();
+    return code;
+}
+
+void Compiler::compile(malValuePtr ast, int dst, bool tail)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, ast)) {
+        compileSymbol(symbol, dst);
+    }
+    else if (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if (!list->isEmpty()) {
+            compileList(ast, dst, tail);
+            return;
+        }
+        emit(malCode::CONST, dst, m_code->constant(ast));
+    }
+    else if (const malVector* vec = DYNAMIC_CAST(malVector, ast)) {
+        compileItems(vec, malCode::MAKE_VECTOR, dst);
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        compileHash(hash, dst);
+    }
+    else if (const malTemplate* tmpl = DYNAMIC_CAST(malTemplate, ast)) {
+        compileTemplate(tmpl, dst);
+    }
+    else {
+        emit(malCode::CONST, dst, m_code->constant(ast));
+    }
+    emitResult(dst, tail);
+}
+
+void Compiler::compileList(malValuePtr ast, int dst, bool tail)
+{
+    // A form which can't be compiled, such as a malformed special form or
+    // a macro which throws, throws when it's run instead, as under EVAL.
+    int start = m_code->here();
+    int top = m_top;
+    const Scope* scope = m_scope;
+    try {
+        compileForm(ast, dst, tail);
+        return;
+    }
+    catch (String& s) {
+        m_code->truncate(start);
+        emit(malCode::THROW, 0, m_code->constant(mal::string(s)));
+    }
+    catch (malValuePtr& o) {
+        m_code->truncate(start);
+        emit(malCode::THROW, 1, m_code->constant(o));
+    }
+    m_top = top;
+    m_scope = scope;
+}
+
+void Compiler::compileForm(malValuePtr ast, int dst, bool tail)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        if ((symbol->special() != malSymbol::NONE) &&
+                compileSpecial(list, dst, tail)) {
+            return;
+        }
+        // A local might hold a macro, but there's no knowing until the
+        // code runs.
+        if (!Scope::binds(m_scope, symbol) && isMacroApplication(ast, m_env)) {
+            compile(macroExpand(ast, m_env), dst, tail);
+            return;
+        }
+    }
+    compileCall(list, ast, dst, tail);
+}
+
+bool Compiler::compileSpecial(const malList* list, int dst, bool tail)
+{
+    const malSymbol* special = STATIC_CAST(malSymbol, list->item(0));
+    int argCount = list->count() - 1;
+
+    switch (special->special()) {
+        case malSymbol::DEF:
+        case malSymbol::DEFMACRO: {
+            bool isMacro = special->special() == malSymbol::DEFMACRO;
+            checkArgsIs(isMacro ? "defmacro!" : "def!", 2, argCount);
+            VALUE_CAST(malSymbol, list->item(1));
+            compile(list->item(2), dst, false);
+            emit(isMacro ? malCode::DEFMACRO : malCode::DEF, dst,
+                 m_code->constant(list->item(1)));
+            emitResult(dst, tail);
+            return true;
+        }
+
+        case malSymbol::DO: {
+            checkArgsAtLeast("do", 1, argCount);
+            for (int i = 1; i < argCount; i++) {
+                compile(list->item(i), dst, false);
+            }
+            compile(list->item(argCount), dst, tail);
+            return true;
+        }
+
+        case malSymbol::FN: {
+            checkArgsIs("fn*", 2, argCount);
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            malSymbolVec params;
+            for (int i = 0; i < bindings->count(); i++) {
+                const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+                params.push_back(sym->interned());
+            }
+            malValuePtr code = compileLambda(params, list->item(2));
+            emit(malCode::CLOSURE, dst, m_code->constant(code));
+            emitResult(dst, tail);
+            return true;
+        }
+
+        case malSymbol::IF: {
+            checkArgsBetween("if", 2, 3, argCount);
+            compile(list->item(1), dst, false);
+            int toElse = emit(malCode::JUMP_IF_FALSE, dst);
+            compile(list->item(2), dst, tail);
+            int toEnd = tail ? -1 : emit(malCode::JUMP);
+            patch(toElse);
+            if (argCount == 3) {
+                compile(list->item(3), dst, tail);
+            }
+            else {
+                emit(malCode::CONST, dst, m_code->constant(mal::nilValue()));
+                emitResult(dst, tail);
+            }
+            if (toEnd >= 0) {
+                patch(toEnd);
+            }
+            return true;
+        }
+
+        case malSymbol::LET: {
+            checkArgsIs("let*", 2, argCount);
+            const malSequence* bindings =
+                VALUE_CAST(malSequence, list->item(1));
+            int count = checkArgsEven("let*", bindings->count());
+            Scope inner(m_scope, m_dynamic);
+            for (int i = 0; i < count; i += 2) {
+                inner.declare(VALUE_CAST(malSymbol, bindings->item(i)));
+            }
+
+            emit(malCode::PUSH_ENV);
+            const Scope* outer = m_scope;
+            m_scope = &inner;
+            for (int i = 0; i < count; i += 2) {
+                compile(bindings->item(i+1), dst, false);
+                emit(malCode::BIND, dst, m_code->constant(bindings->item(i)));
+                inner.bind(STATIC_CAST(malSymbol, bindings->item(i)));
+            }
+            compile(list->item(2), dst, tail);
+            m_scope = outer;
+            if (!tail) {
+                emit(malCode::POP_ENV);
+            }
+            return true;
+        }
+
+        case malSymbol::MACROEXPAND: {
+            checkArgsIs("macroexpand", 1, argCount);
+            emit(malCode::MACROEXPAND, dst, m_code->constant(list->item(1)));
+            emitResult(dst, tail);
+            return true;
+        }
+
+        case malSymbol::QUASIQUOTE: {
+            checkArgsIs("quasiquote", 1, argCount);
+            compile(quasiquote(list->item(1)), dst, tail);
+            return true;
+        }
+
+        case malSymbol::QUOTE: {
+            checkArgsIs("quote", 1, argCount);
+            emit(malCode::CONST, dst, m_code->constant(list->item(1)));
+            emitResult(dst, tail);
+            return true;
+        }
+
+        case malSymbol::TRY: {
+            checkArgsIs("try*", 2, argCount);
+            const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+            checkArgsIs("catch*", 2, catchBlock->count() - 1);
+            MAL_CHECK(VALUE_CAST(malSymbol,
+                catchBlock->item(0))->special() == malSymbol::CATCH,
+                "catch block must begin with catch*");
+            const malSymbol* excSym =
+                VALUE_CAST(malSymbol, catchBlock->item(1));
+
+            // The body isn't in tail position, as its handler has to stay
+            // in place while it runs.
+            int handler = emit(malCode::TRY, dst);
+            compile(list->item(1), dst, false);
+            emit(malCode::END_TRY);
+            int toEnd = emit(malCode::JUMP);
+
+            m_code->instruction(handler).b = m_code->here();
+            Scope inner(m_scope, m_dynamic);
+            inner.bind(excSym);
+            emit(malCode::PUSH_ENV);
+            emit(malCode::BIND, dst, m_code->constant(catchBlock->item(1)));
+            const Scope* outer = m_scope;
+            m_scope = &inner;
+            compile(catchBlock->item(2), dst, tail);
+            m_scope = outer;
+            if (!tail) {
+                emit(malCode::POP_ENV);
+            }
+
+            patch(toEnd);
+            m_code->instruction(handler).c = m_code->here();
+            emitResult(dst, tail);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+void Compiler::compileCall(const malList* list, malValuePtr ast,
+                           int dst, bool tail)
+{
+    // The operator and arguments go in consecutive registers, starting with
+    // dst if that's the last one in use.
+    int top = m_top;
+    int count = list->count();
+    int base = (dst + 1 == m_top) ? dst : allocate(1);
+    allocate(count - 1);
+
+    compile(list->item(0), base, false);
+    int check = -1;
+    if (DYNAMIC_CAST(malSymbol, list->item(0))) {
+        check = emit(malCode::MACRO_CHECK, base, m_code->constant(ast));
+    }
+    for (int i = 1; i < count; i++) {
+        compile(list->item(i), base + i, false);
+    }
+    emit(tail ? malCode::TAIL_CALL : malCode::CALL, base, count - 1);
+
+    if (check >= 0) {
+        m_code->instruction(check).c = m_code->here();
+        emitResult(base, tail);
+    }
+    if (base != dst) {
+        emit(malCode::MOVE, dst, base);
+    }
+    m_top = top;
+}
+
+void Compiler::compileItems(const malSequence* seq, malCode::Op op, int dst)
+{
+    int top = m_top;
+    int count = seq->count();
+    int base = allocate(count + 1);
+    for (int i = 0; i < count; i++) {
+        compile(seq->item(i), base + i, false);
+    }
+    emit(op, base, count);
+    emit(malCode::MOVE, dst, base);
+    m_top = top;
+}
+
+void Compiler::compileHash(const malHash* hash, int dst)
+{
+    if (hash->isEvaluated()) {
+        emit(malCode::CONST, dst, m_code->constant(malValuePtr(
+            const_cast<malHash*>(hash))));
+        return;
+    }
+
+    // Keys are left as they are; only the values are evaluated.
+    malValuePtr keyList = hash->keys();
+    malValuePtr valueList = hash->values();
+    const malSequence* keys = STATIC_CAST(malSequence, keyList);
+    const malSequence* values = STATIC_CAST(malSequence, valueList);
+    int top = m_top;
+    int count = keys->count();
+    int base = allocate(2 * count + 1);
+    for (int i = 0; i < count; i++) {
+        emit(malCode::CONST, base + 2*i, m_code->constant(keys->item(i)));
+        compile(values->item(i), base + 2*i + 1, false);
+    }
+    emit(malCode::MAKE_HASH, base, 2 * count);
+    emit(malCode::MOVE, dst, base);
+    m_top = top;
+}
+
+void Compiler::compileTemplate(const malTemplate* tmpl, int dst)
+{
+    int top = m_top;
+    int count = tmpl->count();
+    int base = allocate(count + 1);
+    for (int i = 0; i < count; i++) {
+        if (tmpl->kind(i) == malTemplate::QUOTED) {
+            emit(malCode::CONST, base + i, m_code->constant(tmpl->form(i)));
+        }
+        else {
+            compile(tmpl->form(i), base + i, false);
+        }
+    }
+    emit(malCode::QUASIQUOTE, base, m_code->constant(malValuePtr(
+        const_cast<malTemplate*>(tmpl))));
+    emit(malCode::MOVE, dst, base);
+    m_top = top;
+}
+
+void Compiler::compileSymbol(const malSymbol* symbol, int dst)
+{
+    int depth, slot;
+    Scope::find(m_scope, symbol, depth, slot);
+    if (slot >= 0) {
+        emit(malCode::LOCAL, dst, depth, slot);
+    }
+    else {
+        emit(malCode::GLOBAL, dst, depth, m_code->global(symbol));
+    }
+}
+
+malValuePtr Compiler::compileBody(const malSymbolVec& params,
+                                  malValuePtr body, malEnvPtr env)
+{
+    // Only the parameters get slots; the names from further out are found
+    // by name, as in an analysed body.
+    Compiler compiler(NULL, NULL, false, env);
+    return compiler.compileLambda(params, body);
+}
+
+malValuePtr compileBody(const malSymbolVec& params, malValuePtr body,
+                        malEnvPtr env)
+{
+    return Compiler::compileBody(params, body, env);
+}
+
+malValuePtr Compiler::compileLambda(const malSymbolVec& params,
+                                    malValuePtr body)
+{
+    unsigned epoch = malAnalysedList::macroEpoch();
+    bool dynamic = definesAnything(body);
+    Scope scope(m_scope, dynamic);
+    for (auto it = params.begin(), end = params.end(); it != end; ++it) {
+        if ((*it)->value() != "&") {
+            scope.bind(*it);
+        }
+    }
+
+    malValuePtr code(new malCode(params));
+    STATIC_CAST(malCode, code)->setSource(body, epoch);
+    Compiler compiler(STATIC_CAST(malCode, code), &scope, dynamic, m_env);
+    compiler.compile(body, 0, true);
+    STATIC_CAST(malCode, code)->finish();
+    return code;
+}
+
+static malValuePtr evalCompiled(malValuePtr ast, malEnvPtr env)
+{
+    // The forms in a do at the top level are compiled one at a time, just
+    // before each one runs, so that a macro defined by one is expanded in
+    // the rest. load-file wraps a whole file in a do.
+    while (const malList* list = DYNAMIC_CAST(malList, ast)) {
+        if ((list->count() < 2) || !isSymbol(list->item(0), malSymbol::DO)) {
+            malValuePtr code = Compiler::compile(ast, env);
+            return STATIC_CAST(malCode, code)->run(env);
+        }
+        int last = list->count() - 1;
+        for (int i = 1; i < last; i++) {
+            EVAL(list->item(i), env);
+        }
+        ast = list->item(last);
+    }
+    return EVAL(ast, env);
+}
+
 static const char* macroTable[] = {
     "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
     "(defmacro! or (fn* (& xs) (if (empty? xs) nil (if (= 1 (count xs)) (first xs) `(let* (or_FIXME ~(first xs)) (if or_FIXME or_FIXME (or ~@(rest xs))))))))",